@@ -2,11 +2,17 @@
 # build_git_tui.sh
 
 # Compile the program
-g++ -o git-tui main.cpp \
+g++ -std=c++17 -pthread -o git-tui main.cpp \
     -I/opt/homebrew/opt/libgit2/include \
     -L/opt/homebrew/opt/libgit2/lib \
     -lncurses -lgit2
 
+# Synthetic repository generator for --bench runs
+g++ -std=c++17 -o gen-repo gen_repo.cpp \
+    -I/opt/homebrew/opt/libgit2/include \
+    -L/opt/homebrew/opt/libgit2/lib \
+    -lgit2
+
 # Copy to a bin directory
 mkdir -p ~/bin
 cp git-tui ~/bin/
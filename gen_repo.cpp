@@ -0,0 +1,270 @@
+// gen-repo: writes reproducible synthetic repositories to benchmark git-tui
+// against (see "Benchmarking" in the README). The same arguments always give
+// the same commits, down to the oids.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <git2.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#define BASE_TIME 1700000000     // First commit time; each commit is a minute later
+#define LAYOUT_DIRS 10           // Tree of the linear and merges shapes: d0..d9
+#define LAYOUT_FILES 100         // Files per directory: f0.txt..f99.txt
+#define FILE_LINES 40            // Lines per generated file
+#define MANY_FILES_PER_DIR 1000  // Directory size of the manyfiles shape
+#define MANY_FILE_LINES 8
+#define MERGE_WIDTH 16           // Branches joined by each octopus merge
+#define SEED 0x9e3779b97f4a7c15ULL
+
+// Deterministic xorshift generator; rand() differs between platforms
+struct Random {
+    uint64_t state = SEED;
+    uint32_t next(uint32_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (uint32_t)(state % bound);
+    }
+};
+
+// A file is its path plus a revision per line; editing a line bumps its
+// revision, so diffs stay as small or as large as the shape asks for
+struct GenFile {
+    string name;
+    vector<uint32_t> line_revs;
+    git_oid blob;
+};
+
+struct GenDir {
+    string name;
+    vector<GenFile> files;
+    git_oid tree;
+};
+
+struct Generator {
+    git_repository* repo = NULL;
+    Random random;
+    vector<GenDir> dirs;
+    git_oid root;
+    int64_t clock = BASE_TIME;
+    size_t commits = 0;
+};
+
+// Helper function to stop on any libgit2 failure
+void check(int error, const char* what) {
+    if (error < 0) {
+        const git_error* e = git_error_last();
+        fprintf(stderr, "gen-repo: %s: %s\n", what, e ? e->message : "unknown error");
+        exit(1);
+    }
+}
+
+// Helper function to write a file's current content as a blob
+void write_file(Generator& gen, const string& dir, GenFile& file) {
+    string content;
+    char line[128];
+    for (size_t i = 0; i < file.line_revs.size(); i++) {
+        int length = snprintf(line, sizeof(line), "line %zu of %s/%s, revision %u\n", i,
+                              dir.c_str(), file.name.c_str(), file.line_revs[i]);
+        content.append(line, length);
+    }
+    check(git_blob_create_from_buffer(&file.blob, gen.repo, content.data(), content.size()), "write blob");
+}
+
+// Helper function to write the tree of one directory from its blobs
+void write_dir(Generator& gen, GenDir& dir) {
+    git_treebuilder* builder = NULL;
+    check(git_treebuilder_new(&builder, gen.repo, NULL), "new tree");
+    for (const GenFile& file : dir.files)
+        check(git_treebuilder_insert(NULL, builder, file.name.c_str(), &file.blob, GIT_FILEMODE_BLOB), "insert blob");
+    check(git_treebuilder_write(&dir.tree, builder), "write tree");
+    git_treebuilder_free(builder);
+}
+
+// Helper function to write the root tree from the directory trees
+void write_root(Generator& gen) {
+    git_treebuilder* builder = NULL;
+    check(git_treebuilder_new(&builder, gen.repo, NULL), "new tree");
+    for (const GenDir& dir : gen.dirs)
+        check(git_treebuilder_insert(NULL, builder, dir.name.c_str(), &dir.tree, GIT_FILEMODE_TREE), "insert tree");
+    check(git_treebuilder_write(&gen.root, builder), "write tree");
+    git_treebuilder_free(builder);
+}
+
+// Helper function to lay out num_dirs directories of files_per_dir files
+// (the last one holding the remainder of total_files) and write them all
+void build_layout(Generator& gen, size_t num_dirs, size_t files_per_dir, size_t total_files, size_t lines) {
+    gen.dirs.assign(num_dirs, GenDir());
+    for (size_t d = 0; d < num_dirs; d++) {
+        GenDir& dir = gen.dirs[d];
+        dir.name = "d" + to_string(d);
+        size_t count = min(files_per_dir, total_files - d * files_per_dir);
+        dir.files.resize(count);
+        for (size_t f = 0; f < count; f++) {
+            dir.files[f].name = "f" + to_string(f) + ".txt";
+            dir.files[f].line_revs.assign(lines, 0);
+            write_file(gen, dir.name, dir.files[f]);
+        }
+        write_dir(gen, dir);
+    }
+    write_root(gen);
+}
+
+// Helper function to edit one random line of a file and rewrite its tree path
+void edit_file(Generator& gen, size_t d, size_t f) {
+    GenDir& dir = gen.dirs[d];
+    GenFile& file = dir.files[f];
+    file.line_revs[gen.random.next(file.line_revs.size())]++;
+    write_file(gen, dir.name, file);
+    write_dir(gen, dir);
+    write_root(gen);
+}
+
+// Helper function to commit the current root tree. Only commits passed
+// update_head move the branch; the others are reachable through merges.
+git_oid commit(Generator& gen, const vector<git_oid>& parent_ids, const string& message, bool update_head = true) {
+    git_signature* signature = NULL;
+    check(git_signature_new(&signature, "Bench Author", "bench@example.com", gen.clock, 0), "signature");
+    gen.clock += 60;
+
+    git_tree* tree = NULL;
+    check(git_tree_lookup(&tree, gen.repo, &gen.root), "lookup tree");
+    vector<git_commit*> parents(parent_ids.size());
+    for (size_t i = 0; i < parent_ids.size(); i++)
+        check(git_commit_lookup(&parents[i], gen.repo, &parent_ids[i]), "lookup parent");
+
+    git_oid id;
+    check(git_commit_create(&id, gen.repo, update_head ? "HEAD" : NULL, signature, signature, NULL,
+                            message.c_str(), tree, parents.size(), (const git_commit**)parents.data()),
+          "commit");
+
+    for (git_commit* parent : parents) git_commit_free(parent);
+    git_tree_free(tree);
+    git_signature_free(signature);
+    gen.commits++;
+    return id;
+}
+
+// Deep linear history: every commit edits one line of one file
+void generate_linear(Generator& gen, size_t count) {
+    build_layout(gen, LAYOUT_DIRS, LAYOUT_FILES, LAYOUT_DIRS * LAYOUT_FILES, FILE_LINES);
+    git_oid tip = commit(gen, {}, "Initial layout");
+    for (size_t i = 1; i < count; i++) {
+        size_t d = gen.random.next(LAYOUT_DIRS);
+        size_t f = gen.random.next(LAYOUT_FILES);
+        edit_file(gen, d, f);
+        tip = commit(gen, {tip}, "Edit d" + to_string(d) + "/f" + to_string(f) + ".txt (" + to_string(i) + ")");
+    }
+}
+
+// Wide merges: each round forks MERGE_WIDTH one-commit branches off the
+// mainline, each editing its own file, and joins them in an octopus merge
+void generate_merges(Generator& gen, size_t rounds) {
+    build_layout(gen, LAYOUT_DIRS, LAYOUT_FILES, LAYOUT_DIRS * LAYOUT_FILES, FILE_LINES);
+    git_oid tip = commit(gen, {}, "Initial layout");
+    size_t total_files = LAYOUT_DIRS * LAYOUT_FILES;
+    for (size_t round = 0; round < rounds; round++) {
+        vector<git_oid> parents = {tip};
+        git_oid base_root = gen.root;
+        vector<GenFile> edited;
+        for (size_t b = 0; b < MERGE_WIDTH; b++) {
+            // Branch b starts from the mainline tree and edits one file
+            size_t slot = (round * MERGE_WIDTH + b) % total_files;
+            size_t d = slot / LAYOUT_FILES;
+            size_t f = slot % LAYOUT_FILES;
+            GenDir base = gen.dirs[d];
+            edit_file(gen, d, f);
+            parents.push_back(commit(gen, {tip}, "Branch " + to_string(b) + " of round " + to_string(round), false));
+            edited.push_back(gen.dirs[d].files[f]);
+            gen.dirs[d] = base;
+            gen.root = base_root;
+        }
+
+        // The merge takes every branch's edit; they never touch the same file
+        for (size_t b = 0; b < MERGE_WIDTH; b++) {
+            size_t slot = (round * MERGE_WIDTH + b) % total_files;
+            gen.dirs[slot / LAYOUT_FILES].files[slot % LAYOUT_FILES] = edited[b];
+        }
+        for (GenDir& dir : gen.dirs) write_dir(gen, dir);
+        write_root(gen);
+        tip = commit(gen, parents, "Merge round " + to_string(round));
+    }
+}
+
+// Huge diff: one file of megabytes MB, then a commit changing every line
+void generate_hugediff(Generator& gen, size_t megabytes) {
+    size_t lines = megabytes * 1024 * 1024 / 40;
+    build_layout(gen, 1, 1, 1, lines);
+    git_oid tip = commit(gen, {}, "Add a " + to_string(megabytes) + " MB file");
+    GenFile& file = gen.dirs[0].files[0];
+    for (uint32_t& revision : file.line_revs) revision++;
+    write_file(gen, gen.dirs[0].name, file);
+    write_dir(gen, gen.dirs[0]);
+    write_root(gen);
+    commit(gen, {tip}, "Rewrite every line of the " + to_string(megabytes) + " MB file");
+}
+
+// Many-file commit: count files added, then one commit editing all of them
+void generate_manyfiles(Generator& gen, size_t count) {
+    size_t num_dirs = (count + MANY_FILES_PER_DIR - 1) / MANY_FILES_PER_DIR;
+    build_layout(gen, num_dirs, MANY_FILES_PER_DIR, count, MANY_FILE_LINES);
+    git_oid tip = commit(gen, {}, "Add " + to_string(count) + " files");
+    for (GenDir& dir : gen.dirs) {
+        for (GenFile& file : dir.files) {
+            file.line_revs[gen.random.next(file.line_revs.size())]++;
+            write_file(gen, dir.name, file);
+        }
+        write_dir(gen, dir);
+    }
+    write_root(gen);
+    commit(gen, {tip}, "Edit all " + to_string(count) + " files");
+}
+
+void print_usage(const char* program_name) {
+    fprintf(stderr, "Usage: %s <new_repository_path> <shape> [N]\n", program_name);
+    fprintf(stderr, "Shapes:\n");
+    fprintf(stderr, "  linear N     N commits, each editing one line of one file (default 100000)\n");
+    fprintf(stderr, "  merges N     N rounds of %d branches joined by an octopus merge (default 1000)\n", MERGE_WIDTH);
+    fprintf(stderr, "  hugediff N   A commit rewriting every line of an N MB file (default 64)\n");
+    fprintf(stderr, "  manyfiles N  A commit editing N files at once (default 50000)\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* path = argv[1];
+    string shape = argv[2];
+    long count = argc == 4 ? atol(argv[3]) : 0;
+    if (argc == 4 && count <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    git_libgit2_init();
+    git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, 0);   // Everything referenced was just written
+    Generator gen;
+    check(git_repository_init(&gen.repo, path, 0), "init repository");
+
+    if (shape == "linear") {
+        generate_linear(gen, count ? count : 100000);
+    } else if (shape == "merges") {
+        generate_merges(gen, count ? count : 1000);
+    } else if (shape == "hugediff") {
+        generate_hugediff(gen, count ? count : 64);
+    } else if (shape == "manyfiles") {
+        generate_manyfiles(gen, count ? count : 50000);
+    } else {
+        print_usage(argv[0]);
+        return 1;
+    }
+    printf("%s: %zu commits (%s)\n", path, gen.commits, shape.c_str());
+
+    git_repository_free(gen.repo);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -1,81 +1,4740 @@
 #include <string.h>
 #include <ncurses.h>
 #include <git2.h>
+#include <git2/sys/commit_graph.h>
+#include <git2/sys/hashsig.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <ctime> 
 #include <string> 
+#include <string_view>
 #include <vector>
 #include <iomanip>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <list>
+#include <memory>
+#include <deque>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
 using namespace std;
 
 #define MAX_ROWS 1000
 #define PADDING 2
+#define COMMIT_BATCH_SIZE 4096   // Commits handed to the UI per batch while loading
+#define COMMIT_BATCH_MS 50       // Max time a partial batch waits before being handed over
+#define LOADING_POLL_MS 100      // getch() timeout while history is still loading
+#define COMMIT_INDEX_MAGIC "GTUIIDX"
+#define COMMIT_INDEX_VERSION 3
+#define COMMIT_INDEX_FILE "git-tui-commits.idx"
+#define REFS_INDEX_FILE "git-tui-refs.idx"   // Index of the last --all / --refs history
+#define DEFAULT_FILE_CACHE_MB 64 // Budget for cached changed-file lists
+#define DEFAULT_PREFETCH_DEPTH 8 // Commits prefetched ahead of the cursor
+#define PREFETCH_WORKERS 3       // Background diff threads, each with its own repository
+#define PREFETCH_PATCH_BYTES (512 * 1024)  // Per-commit budget for prefetched patch text
+#define DEFAULT_DIFF_LIMIT_MB 16 // Patch text kept per file before the diff is truncated
+#define DIFF_JOB_POLL_MS 16      // getch() timeout while a diff job is running (one frame)
+#define PATH_MEMO_ENTRIES (1 << 18)  // Tree lookups remembered by a path-limited walk
+#define SEARCH_MIN_CHUNK 32768   // Fewest commits worth giving a search thread of its own
+#define PICKAXE_CHUNK 32         // Commits a pickaxe worker claims at a time
+#define DEFAULT_RENAME_LIMIT 200 // Rename/copy candidates compared per file
+#define DEFAULT_RENAME_MS 250    // Time a commit's similarity pass may take before falling back to exact matches
+#define BENCH_LINES 48           // Screen size of a headless --bench run
+#define BENCH_COLUMNS 160
+#define TRACE_MAX_EVENTS 1000000 // Events kept for --trace; later ones are dropped
+#define OVERLAY_REFRESH_MS 250   // Timings overlay redraw interval while shown
+#define GRAPH_CHECKPOINT_ROWS 64 // Rows between saved lane states of the history graph
+#define GRAPH_MAX_LANES 12       // Lanes drawn before the graph is cut off
+#define BLAME_MARGIN_LINES 200   // Lines blamed above and below the visible ones
+#define BLAME_CACHE_FILES 16     // Blamed (path, commit) pairs kept for reopening
+#define WATCH_POLL_MS 500        // getch() timeout while idle, to notice ref changes
+#define REFRESH_SETTLE_MS 200    // Quiet time after a ref change before the history is refreshed
+#define WORKTREE_POLL_MS 100     // Status worker's wait for working-tree events
+#define WORKTREE_SETTLE_MS 100   // Quiet time after a working-tree change before it is rescanned
+#define WORKTREE_RESCAN_PATHS 20000  // Changed paths past which a full status scan is cheaper
+#define WORKTREE_SCAN_CHUNK 16384    // Tracked files per pass of the first scan, each published as it ends
+#define HIGHLIGHT_CHECKPOINT_LINES 256   // Diff lines between saved tokenizer states
+#define HIGHLIGHT_CACHE_LINES (1 << 18)  // Tokenized blob lines kept across diffs
+#define HIGHLIGHT_MAX_LINE 2048  // Bytes of a line that are tokenized; the rest stays plain
+#define WORD_DIFF_MAX_TOKENS 2048  // Words left after trimming past which a changed line pair is marked whole
+#define WORD_DIFF_MAX_EDITS 128    // Myers edit distance past which a changed line pair is marked whole
+#define CHURN_CACHE_MAGIC "GTUICHN"
+#define CHURN_CACHE_VERSION 2
+#define CHURN_CACHE_FILE "git-tui-churn.idx"   // Per-commit churn kept for analytics reruns
+#define ANALYTICS_CHUNK 64       // Commits an analytics worker claims at a time
+#define ANALYTICS_TOP 20         // Files per ranking in a --stats export
+#define ANALYTICS_MONTHS 6       // Months shown per author in the analytics overlay
 
-struct CommitInfo {
-    string message;
+// Panes redrawn on the next frame; a pane is only drawn when its bit is set
+#define PANE_HISTORY (1 << 0)
+#define PANE_DETAILS (1 << 1)
+#define PANE_FILES   (1 << 2)
+#define PANE_DIFF    (1 << 3)
+#define PANE_STATUS  (1 << 4)
+#define PANE_ALL     (PANE_HISTORY | PANE_DETAILS | PANE_FILES | PANE_DIFF | PANE_STATUS)
+
+// line_hunks values of blame lines without a hunk
+#define BLAME_PENDING -1         // Not blamed yet
+#define BLAME_UNKNOWN -2         // Blamed, but libgit2 returned no hunk for the line
+
+// Sources of a diff other than a commit (DiffJob::worktree, diff_commit_index)
+#define WORKTREE_STAGED -2       // HEAD against the index
+#define WORKTREE_UNSTAGED -3     // The index against the working tree
+
+// Hot paths timed by ScopedTimer, in the order the overlay lists them
+enum TimerId {
+    TIMER_REVWALK,        // One batch of the history walk
+    TIMER_INDEX_LOAD,     // Commits read back from the commit index
+    TIMER_TREE_DIFF,      // git_diff_tree_to_tree of a commit
+    TIMER_FIND_RENAMES,   // Rename/copy pass over a commit's diff
+    TIMER_PATCH_PRINT,    // One file's patch printed into a DiffText
+    TIMER_LINE_STATS,     // One file change's +/- counts
+    TIMER_BLAME,          // Blame of one range of lines
+    TIMER_STATUS,         // One working-tree status pass
+    TIMER_CHURN,          // One commit's per-file line counts for analytics
+    TIMER_GRAPH,          // Lane layout of the visible history rows
+    TIMER_HIGHLIGHT,      // Tokenizing the visible diff rows
+    TIMER_WORDS,          // Intraline changes of the visible diff rows
+    TIMER_FRAME,          // Drawing a frame, screen update included
+    TIMER_DOUPDATE,       // ncurses writing the frame to the terminal
+    TIMER_COUNT
+};
+
+const char* const TIMER_NAMES[TIMER_COUNT] = {
+    "revwalk batch", "commit index load", "tree diff", "rename detection",
+    "patch print", "line stats", "blame", "status scan", "churn diff", "graph layout", "syntax highlight", "word diff", "frame", "screen update",
+};
+
+struct TimerStat {
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> total_ns{0};
+    atomic<uint64_t> max_ns{0};
+    atomic<uint64_t> last_ns{0};
+};
+
+// One span of a Chrome trace ("X" event), in microseconds since startup
+struct TraceEvent {
+    int timer;
+    int thread;
+    double start_us;
+    double duration_us;
+};
+
+// Timings of every thread. Aggregates are lock-free; trace events are only
+// collected with --trace, under the lock.
+struct Instruments {
+    TimerStat timers[TIMER_COUNT];
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool tracing = false;
+    mutex lock;
+    vector<TraceEvent> events;
+    vector<string> thread_names;   // Indexed by trace thread id
+};
+
+Instruments instruments;
+
+// Commit list kept as a struct of arrays: binary oids and times in
+// contiguous arrays, authors interned, subjects packed in one string arena.
+// The full message is loaded on demand for the selected commit only.
+struct CommitStore {
+    vector<git_oid> oids;
+    vector<int64_t> times;
+    vector<uint32_t> authors;          // Index into author_names / author_emails
+    vector<uint32_t> subjects;         // Offset of the NUL-terminated subject in arena
+    vector<uint32_t> parent_starts;    // Index of the commit's first parent in parent_ids
+    vector<git_oid> parent_ids;        // Every commit's parents, back to back
+    string arena;
+    vector<string> author_names;
+    vector<string> author_emails;
+    unordered_map<string, uint32_t> author_ids;   // "name\0email" -> author index
+};
+
+// Ref names shown next to the commit they point at, as in git log --decorate
+struct Decoration {
+    git_oid oid;
+    string label;    // e.g. "HEAD -> main, origin/main, tag: v1.0"
+};
+
+// A ref the history was walked from, and the commit it pointed at
+struct RefTip {
+    string name;
+    git_oid oid;
+};
+
+// Background revwalk that streams commits to the UI thread in batches
+struct CommitLoader {
+    string repo_path;
+    string path;           // Only list commits touching this path, when set
+    string refs;           // Walk from the refs matching this glob instead of HEAD, when set
+    bool with_head = false;   // ...and from HEAD too (--all)
+    atomic<size_t> walked{0};
+    thread worker;
+    mutex lock;
+    CommitStore pending;   // Filled by the worker, drained by the UI loop
+    vector<Decoration> decorations;   // Handed over once, after the first commits
+    bool decorations_ready = false;
+    vector<RefTip> tips;   // Where the walk started, sorted by name; read once done
+    string error;
+    atomic<bool> done{false};
+    atomic<bool> stop{false};
+};
+
+// Background walk of just the commits that appeared since the history was
+// walked: from the refs' new tips, with the old ones hidden. The UI puts
+// them in front of the list, or walks everything again when a ref moved
+// anywhere but forward (a reset, a checkout, a forced fetch).
+struct HistoryRefresh {
+    string repo_path;
+    string path;
+    string refs;
+    bool with_head = false;
+    vector<RefTip> old_tips;
+    thread worker;
+    atomic<bool> done{false};
+    // Read by the UI once done
+    bool reload = false;
+    vector<RefTip> tips;
+    CommitStore commits;   // Newest first, all newer than the listed ones
+    vector<Decoration> decorations;
+    string error;
+};
+
+// inotify watch on HEAD and packed-refs (through the git directory) and on
+// every directory under refs/, which gets new watches as directories appear
+struct RefsWatch {
+    int fd = -1;
+    int git_dir_watch = -1;
+    unordered_map<int, string> dirs;   // Watch descriptor -> directory under refs/
+    bool changed = false;
+    chrono::steady_clock::time_point last_change;   // Refreshing waits for the refs to settle
+};
+
+// On-disk commit index: a header followed by the CommitStore arrays as
+// sections, so loading it is a handful of memcpys. Keyed by the tip it was
+// built from so later runs only walk newer commits.
+struct CommitIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t parent_count;
+    uint64_t count;
+    uint64_t author_count;
+    uint64_t arena_size;
+    git_oid tip;
+    char padding[4];
+};
+
+static_assert(sizeof(CommitIndexHeader) == 64, "commit index header layout");
+
+// A commit index file mapped read-only into memory
+struct CommitIndex {
+    void* map = NULL;
+    size_t map_size = 0;
+    const CommitIndexHeader* header = NULL;
+    const char* oids = NULL;          // git_oid[count]
+    const char* times = NULL;         // int64_t[count]
+    const char* authors = NULL;       // uint32_t[count]
+    const char* subjects = NULL;      // uint32_t[count]
+    const char* parent_starts = NULL; // uint32_t[count]
+    const char* parent_ids = NULL;    // git_oid[parent_count]
+    const char* author_table = NULL;  // uint32_t[author_count][2], name/email arena offsets
+    const char* arena = NULL;
+};
+
+// One file's patch as a single contiguous buffer plus a line-offset index.
+// Lines are only turned into screen output for the rows that are visible.
+struct DiffText {
+    string bytes;                 // Line contents back to back, without newlines
+    vector<uint32_t> offsets;     // Start of each line in bytes, plus an end sentinel
+    string origins;               // '+', '-', ' ', 'F', 'H' or 'B' per line
+    bool binary = false;
+    bool truncated = false;       // Stopped at limit bytes
+    size_t limit = 0;
+};
+
+// One entry of a commit's changed-file list
+struct FileDelta {
+    git_delta_t status;
+    string old_path;
+    string new_path;
+    git_oid old_id;
+    git_oid new_id;
+    uint16_t similarity = 0;  // Percent, for renames and copies
+};
+
+// Changed-file list of one commit against its first parent, plus the patch
+// lines of the files a prefetch worker had budget for (NULL otherwise)
+struct ChangedFiles {
+    vector<FileDelta> files;
+    vector<shared_ptr<const DiffText>> patches;
+    size_t bytes = 0;     // Approximate memory held, for the cache budget
+};
+
+struct OidHash {
+    size_t operator()(const git_oid& oid) const {
+        size_t hash;
+        memcpy(&hash, oid.id, sizeof(hash));   // Oids are already uniformly distributed
+        return hash;
+    }
+};
+
+struct OidEqual {
+    bool operator()(const git_oid& a, const git_oid& b) const {
+        return git_oid_equal(&a, &b);
+    }
+};
+
+// Lane layout of the history graph. Each lane holds the commit it is
+// heading for (a zero oid when free). The lanes entering every
+// GRAPH_CHECKPOINT_ROWS-th row are saved as the layout grows, so drawing
+// any screenful replays at most one checkpoint interval.
+// The walk lists commits by date, so with clock skew a parent can come
+// before its child; no lane is kept heading for a row already drawn.
+struct LaneGraph {
+    vector<vector<git_oid>> checkpoints;   // Lanes entering row k * GRAPH_CHECKPOINT_ROWS
+    vector<git_oid> lanes;                 // Lanes entering row rows_done
+    size_t rows_done = 0;
+    unordered_map<git_oid, uint32_t, OidHash, OidEqual> rows;   // Row of every commit laid out
+};
+
+// Path of a path-limited walk, with the entry each tree along it was last
+// seen to hold. A commit's tree is looked at again as its parent's, so
+// most lookups never have to read the tree.
+struct PathFilter {
+    vector<string> components;
+    vector<unordered_map<git_oid, git_oid, OidHash, OidEqual>> children;  // Per depth: tree -> entry
+    size_t memo_entries = 0;
+};
+
+// How hard rename/copy detection tries before settling for exact matches
+struct RenameLimits {
+    size_t candidates = DEFAULT_RENAME_LIMIT;   // 0 disables detection
+    int budget_ms = DEFAULT_RENAME_MS;
+};
+
+// Bounded LRU of changed-file lists keyed by commit oid, shared between the
+// UI and the prefetch workers. The lock is never held during git work.
+// Entries are shared_ptrs so the list on screen stays valid if evicted.
+struct FileListCache {
+    typedef pair<git_oid, shared_ptr<const ChangedFiles>> Entry;
+    mutex lock;
+    list<Entry> entries;      // Most recently used first
+    unordered_map<git_oid, list<Entry>::iterator, OidHash, OidEqual> lookup;
+    size_t capacity_bytes = DEFAULT_FILE_CACHE_MB * 1024 * 1024;
+    size_t used_bytes = 0;
+    atomic<size_t> hits{0};
+    atomic<size_t> misses{0};
+    RenameLimits renames;     // Applied to every list that goes in
+};
+
+// The selected commit's diff, kept for as long as it stays selected so that
+// picking files only has to diff that file's blobs
+struct SelectedDiff {
+    git_oid oid;
+    git_diff* diff = NULL;
+};
+
+// A foreground job is stale as soon as the UI posts a newer one; git work
+// checks this from libgit2's callbacks and gives up early
+struct DiffCancel {
+    const atomic<unsigned>* current;
+    unsigned generation;
+};
+
+// Foreground git work for the selection: the changed-file list of a commit
+// (file_index < 0) or the patch of one of its files
+struct DiffJob {
+    unsigned generation;
+    git_oid oid;
+    int file_index;
+    FileDelta file;     // The listed file, for finding it in the worker's diff
+    size_t limit;
+    int worktree = 0;   // WORKTREE_STAGED or WORKTREE_UNSTAGED for a working-tree file
+};
+
+// Single worker that runs the UI's diff jobs off the input thread. Only the
+// newest job matters, so posting replaces whatever is still waiting.
+struct DiffJobs {
+    string repo_path;
+    FileListCache* cache = NULL;
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    bool has_job = false;
+    DiffJob job;
+    bool has_result = false;
+    DiffJob result_job;
+    shared_ptr<const ChangedFiles> files;    // Result of a file-list job
+    shared_ptr<const DiffText> text;         // Result of a patch job
+    bool stop = false;
+    atomic<unsigned> generation{0};
+};
+
+// Worker pool that diffs the commits around the cursor ahead of time
+struct Prefetcher {
+    string repo_path;
+    FileListCache* cache = NULL;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    deque<git_oid> queue;    // Nearest commits first; replaced on every move
+    bool stop = false;
+    atomic<size_t> prefetched{0};
+};
+
+// Added/deleted line counts of one file change
+struct LineStats {
+    uint32_t added = 0;
+    uint32_t deleted = 0;
+    bool binary = false;
+};
+
+// A file change by content: the blobs before and after
+struct BlobPair {
+    git_oid old_id;
+    git_oid new_id;
+};
+
+struct BlobPairHash {
+    size_t operator()(const BlobPair& pair) const {
+        return OidHash()(pair.old_id) * 31 + OidHash()(pair.new_id);
+    }
+};
+
+struct BlobPairEqual {
+    bool operator()(const BlobPair& a, const BlobPair& b) const {
+        return git_oid_equal(&a.old_id, &b.old_id) && git_oid_equal(&a.new_id, &b.new_id);
+    }
+};
+
+// Per-file diffstat, counted by one background worker and memoized by blob
+// pair, so the same change reached through another commit or a merge is
+// never counted twice. The UI queues the visible rows first.
+struct DiffStats {
+    string repo_path;
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    unordered_map<BlobPair, LineStats, BlobPairHash, BlobPairEqual> counted;
+    deque<BlobPair> queue;   // Visible rows first; replaced when the view moves
+    shared_ptr<const ChangedFiles> queued_list;   // List the queue was built from
+    LineStats queued_total;  // Sum over the queue so far, complete once it drains
+    bool stop = false;
+    atomic<size_t> computed{0};
+};
+
+// One blame hunk: the commit that last changed a run of lines
+struct BlameHunk {
+    git_oid commit;
     string author;
-    string email;
-    string commit_id;
-    time_t commit_time;
+    int64_t time;
+};
+
+// Blame of one file at one commit, filled in range by range as the view
+// scrolls. Everything but commit and path is guarded by the BlameJobs lock.
+struct BlameFile {
+    git_oid commit;
+    string path;
+    bool loaded = false;          // Content read and line_hunks sized
+    string error;
+    string bytes;                 // File content, lines back to back without newlines
+    vector<uint32_t> offsets;     // Start of each line in bytes, plus an end sentinel
+    vector<BlameHunk> hunks;
+    vector<int32_t> line_hunks;   // Hunk of each line; BLAME_PENDING until blamed
+};
+
+// Single worker that blames ranges of lines with git_blame_options
+// min_line/max_line, so a long file's history is only traced for the lines
+// around the view. The UI hands over the next range once the last is done.
+struct BlameJobs {
+    string repo_path;
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    shared_ptr<BlameFile> job_file;   // Waiting request, NULL when none
+    int job_first = 0;                // Lines to blame, inclusive and 0-based
+    int job_last = 0;
+    bool busy = false;                // A request is waiting or being worked on
+    bool stop = false;
+    atomic<unsigned> finished{0};     // Requests completed, to tell the UI to redraw
+    list<shared_ptr<BlameFile>> cache;   // Most recently opened first; UI thread only
+};
+
+// The diff pane's blame view, when open
+struct BlameView {
+    shared_ptr<BlameFile> file;
+    int starting_line = 0;
+    int cursor_position = 1;
+    string note;                  // Shown in the title, e.g. when a jump fails
+};
+
+// Working-tree status for the 'w' view. A worker lists the staged and
+// unstaged changes with its own repository handle, streaming the first scan
+// in passes of about WORKTREE_SCAN_CHUNK tracked files, with directories
+// larger than that split into passes of their own. It then watches every
+// directory git does not ignore with inotify, and rescans only the paths
+// reported.
+struct WorktreeStatus {
+    string repo_path;
+    thread worker;
+    mutex lock;
+    shared_ptr<const ChangedFiles> files;   // Staged changes, then unstaged ones
+    size_t staged = 0;                      // How many of files are staged
+    unsigned version = 0;                   // Bumped with every new files
+    bool scanning = true;                   // The first full scan is still under way
+    bool watching = false;                  // Every directory is watched; rescans are limited
+    string error;
+    bool index_dirty = false;               // Set by the UI when HEAD moved
+    bool full_rescan = false;               // Set by the UI when the watches cannot be trusted
+    atomic<bool> stop{false};
+    // Owned by the worker
+    git_repository* repo = NULL;
+    string workdir;                         // Without the trailing slash
+    int fd = -1;
+    int git_dir_watch = -1;
+    unordered_map<int, string> dirs;        // Watch descriptor -> directory ("" is the workdir)
+    vector<FileDelta> staged_files;
+    vector<FileDelta> unstaged_files;
+};
+
+// Headless --bench run: keys come from a script instead of the terminal,
+// and each one is timed until the UI has settled again
+struct Bench {
+    bool enabled = false;
+    vector<int> keys;
+    size_t next_key = 0;
+    bool done = false;
+    chrono::steady_clock::time_point start;      // Process start
+    double first_frame_ms = -1;                  // First frame with commits on it
+    double loaded_ms = -1;                       // History walk finished
+    bool key_in_flight = false;
+    chrono::steady_clock::time_point key_start;
+    double key_render_ms = 0;                    // Drawing time spent on the key so far
+    vector<double> total_ms;
+    vector<double> render_ms;
+};
+
+// Incremental search over the commit list's subjects and authors
+struct CommitSearch {
+    bool active = false;        // The prompt is open and keys edit the query
+    bool pickaxe = false;       // The open prompt asks for a pickaxe string instead
+    string query;
+    int origin = 0;             // Selection when the prompt opened, restored on Esc
+    vector<int> matches;        // Matching rows of the history pane, in order
+    string folded_arena;        // Lowercased copy of the subject arena, grown as
+                                // commits load, for case-insensitive queries
+};
+
+// Content search across history, like git log -S: finds the commits that
+// change how often a string occurs in some file. Workers claim chunks of
+// the list from a shared counter, so a fast worker simply takes more.
+struct Pickaxe {
+    string repo_path;
+    string needle;
+    vector<git_oid> oids;       // Snapshot of the list being searched
+    vector<thread> workers;
+    atomic<size_t> next{0};     // First commit of the next unclaimed chunk
+    atomic<size_t> scanned{0};
+    atomic<int> running{0};
+    atomic<bool> stop{false};
+    mutex lock;
+    vector<int> found;          // Matches not yet picked up by the UI
+};
+
+// Lines one commit added and deleted in one file
+struct FileChurn {
+    uint32_t path;      // Index into ChurnCache::paths
+    uint32_t added;
+    uint32_t deleted;
+};
+
+// Where a commit's files are in ChurnCache::files
+struct CommitChurn {
+    uint32_t first;
+    uint32_t count;
+};
+
+// Per-file churn of every commit analyzed so far, against its first
+// parent. Saved next to the commit index, keyed by commit, so a later run
+// only diffs the commits that are new.
+struct ChurnCache {
+    unordered_map<git_oid, CommitChurn, OidHash, OidEqual> commits;
+    vector<FileChurn> files;
+    vector<string> paths;
+    unordered_map<string, uint32_t> path_ids;
+    bool loaded = false;
+    vector<git_oid> pending;     // Commits added since the last save
+    string file;                 // The file loaded or last saved, empty when none
+    size_t saved_commits = 0;    // What that file holds, so a save only appends the rest
+    size_t saved_files = 0;
+    size_t saved_paths = 0;
+};
+
+struct FileTotals {
+    uint64_t added = 0;
+    uint64_t deleted = 0;
+    uint32_t commits = 0;
+    uint32_t authors = 0;   // Filled in when the partial results are merged
+};
+
+// Aggregates over a set of commits: one per worker for the ranges it
+// claimed, then all of them merged
+struct AnalyticsTotals {
+    unordered_map<uint64_t, uint32_t> author_months;   // author << 32 | month -> commits
+    unordered_map<uint32_t, FileTotals> files;         // By path
+    unordered_set<uint64_t> file_authors;              // path << 32 | author, for each pair seen
+};
+
+// Who touched what over a snapshot of the history: commits per author per
+// month, and per file the lines changed and how many authors changed
+// them. Workers claim ranges of the snapshot like the pickaxe's, map each
+// commit to its churn (from the cache, or diffed when new) and reduce it
+// into their own totals; a coordinator merges those and saves the cache.
+// Merges count as commits but, as in git log --numstat, change no files.
+struct Analytics {
+    string repo_path;
+    string path;                        // Only count files at or below this path, when set
+    vector<git_oid> oids;               // Snapshot of the list being analyzed
+    vector<uint32_t> authors;
+    vector<uint32_t> months;            // Commit month, as year * 12 + month
+    vector<bool> merges;
+    vector<string> author_names;        // "Name <email>" by author id
+    ChurnCache* cache = NULL;           // Only paths grow (under lock) while workers run
+    vector<vector<FileChurn>> fresh;    // Churn of the commits diffed in this run
+    vector<char> diffed;                // Not vector<bool>: workers set neighbouring entries
+    thread coordinator;
+    vector<AnalyticsTotals> partials;   // One per worker
+    atomic<size_t> next{0};             // First commit of the next unclaimed range
+    atomic<size_t> analyzed{0};
+    atomic<size_t> diff_count{0};
+    atomic<bool> stop{false};
+    atomic<bool> done{false};
+    mutex lock;                         // Guards cache->paths and cache->path_ids
+    AnalyticsTotals totals;             // Read once done
+    string error;
 };
 
 struct DiffContent {
-    vector<string> lines;
+    shared_ptr<const DiffText> text;
+    git_oid old_id;     // Blobs of the shown file, which key its cached tokens
+    git_oid new_id;
+    size_t limit;
     int starting_line;
     int cursor_position;
     int lines_to_display;
 };
 
+// Syntax highlighting of diff lines. A language is a row of this table,
+// picked by file extension; the tokenizer only reads it.
+struct Language {
+    const char* extensions;      // Space separated
+    const char* keywords;        // Space separated
+    const char* line_comment;
+    const char* block_open;      // NULL without block comments
+    const char* block_close;
+    const char* quotes;          // Single-line string delimiters
+    bool triple_quotes;          // Python's """ and ''' strings, which span lines
+    bool backtick_strings;       // `...` strings, which span lines
+    bool preprocessor;           // # lines are preprocessor directives
+};
+
+enum TokenKind : uint8_t {
+    TOKEN_KEYWORD,
+    TOKEN_STRING,
+    TOKEN_COMMENT,
+    TOKEN_NUMBER,
+    TOKEN_PREPROCESSOR,
+};
+
+// States a line can leave the tokenizer in, for constructs spanning lines
+enum TokenState : uint8_t {
+    STATE_NORMAL,
+    STATE_BLOCK_COMMENT,
+    STATE_TRIPLE_DOUBLE,
+    STATE_TRIPLE_SINGLE,
+    STATE_BACKTICK,
+};
+
+struct TokenSpan {
+    uint16_t start;      // Byte offset in the line, after the +/-/space marker
+    uint16_t length;
+    TokenKind kind;
+};
+
+// Tokens of one line of a blob, valid for lines entered in state_in
+struct LineTokens {
+    TokenState state_in;
+    TokenState state_out;
+    vector<TokenSpan> spans;
+};
+
+// Tokens of the blob lines shown so far, by line number. Blobs never
+// change, so a file seen again, or as the other side of the next commit's
+// diff, reuses them.
+struct BlobTokens {
+    git_oid oid;
+    unordered_map<uint32_t, LineTokens> lines;
+};
+
+struct HighlightCache {
+    list<BlobTokens> blobs;      // Most recently used first
+    unordered_map<git_oid, list<BlobTokens>::iterator, OidHash, OidEqual> index;
+    size_t lines = 0;            // Lines cached over all blobs, against HIGHLIGHT_CACHE_LINES
+};
+
+// Where the tokenizer stands entering a diff line: each side's next line
+// number and state ("-" lines read the old blob, "+" lines the new one)
+struct HighlightPosition {
+    uint32_t old_line = 0;
+    uint32_t new_line = 0;
+    TokenState old_state = STATE_NORMAL;
+    TokenState new_state = STATE_NORMAL;
+};
+
+// Highlighting of the shown diff. The position entering every
+// HIGHLIGHT_CHECKPOINT_LINES-th line is saved as the view moves down, so
+// any screenful replays at most one checkpoint interval.
+struct DiffHighlight {
+    shared_ptr<const DiffText> text;   // The diff this is for
+    const Language* language = NULL;   // NULL: plain, e.g. an unknown extension
+    git_oid old_id;
+    git_oid new_id;
+    vector<HighlightPosition> checkpoints;
+};
+
+// Removed lines [minus_start, plus_start) of a hunk directly followed by the
+// lines [plus_start, end) that replaced them. The k-th removed line pairs
+// with the k-th added one, both for intraline changes and side by side.
+struct ChangeBlock {
+    uint32_t minus_start;
+    uint32_t plus_start;
+    uint32_t end;
+};
+
+// Changed bytes of a line, after its +/- marker
+struct WordRange {
+    uint32_t start;
+    uint32_t length;
+};
+
+// Intraline changes of the shown diff, worked out for the change blocks
+// that come into view and kept until another diff is shown
+struct DiffWords {
+    shared_ptr<const DiffText> text;
+    unordered_map<uint32_t, vector<WordRange>> lines;   // By diff line; empty when nothing is marked
+};
+
+// Rows of the side-by-side layout: a line per row, except that the paired
+// lines of a change block share one. Built in one pass over the origins
+// when a diff is first shown this way, then searched for every row.
+struct SideBySide {
+    shared_ptr<const DiffText> text;
+    vector<ChangeBlock> blocks;      // Blocks with both removed and added lines
+    vector<uint32_t> first_rows;     // Row of each block's first line
+    int rows = 0;
+};
+
+// Trace thread id of the calling thread, -1 until it records or is named
+thread_local int trace_thread_id = -1;
+
+// Helper function to give the calling thread its trace id and a name;
+// unnamed threads are numbered. Needs the instruments lock.
+void assign_trace_thread(const char* name) {
+    if (trace_thread_id < 0) {
+        trace_thread_id = instruments.thread_names.size();
+        instruments.thread_names.push_back("");
+    }
+    instruments.thread_names[trace_thread_id] = name ? name : "thread " + to_string(trace_thread_id);
+}
+
+void name_trace_thread(const char* name) {
+    lock_guard<mutex> guard(instruments.lock);
+    assign_trace_thread(name);
+}
+
+// Helper function to add one timed span to its aggregate and the trace
+void record_timing(int timer, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    TimerStat& stat = instruments.timers[timer];
+    stat.count++;
+    stat.total_ns += ns;
+    stat.last_ns = ns;
+    uint64_t max_ns = stat.max_ns.load();
+    while (ns > max_ns && !stat.max_ns.compare_exchange_weak(max_ns, ns)) {}
+
+    if (!instruments.tracing) return;
+    lock_guard<mutex> guard(instruments.lock);
+    if (trace_thread_id < 0) assign_trace_thread(NULL);
+    if (instruments.events.size() >= TRACE_MAX_EVENTS) return;
+    double start_us = chrono::duration<double, micro>(start - instruments.start).count();
+    instruments.events.push_back({timer, trace_thread_id, start_us, ns / 1000.0});
+}
+
+// Times the enclosing scope
+struct ScopedTimer {
+    int timer;
+    chrono::steady_clock::time_point start;
+    explicit ScopedTimer(int timer) : timer(timer), start(chrono::steady_clock::now()) {}
+    ~ScopedTimer() { record_timing(timer, start, chrono::steady_clock::now()); }
+};
+
+// Helper function to write the collected spans in Chrome's trace event
+// format, for chrome://tracing or Perfetto
+bool write_trace(const string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    lock_guard<mutex> guard(instruments.lock);
+    fprintf(file, "{\"traceEvents\":[");
+    const char* separator = "\n";
+    for (size_t i = 0; i < instruments.thread_names.size(); i++) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                separator, i, instruments.thread_names[i].c_str());
+        separator = ",\n";
+    }
+    for (const TraceEvent& event : instruments.events) {
+        fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                separator, TIMER_NAMES[event.timer], event.thread, event.start_us, event.duration_us);
+        separator = ",\n";
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return true;
+}
+
+void print_usage(const char* program_name) {
+    fprintf(stderr, "Usage: %s [options] <repository_path> [-- <path>]\n", program_name);
+    fprintf(stderr, "Example: %s /path/to/git/repo -- src/main.cpp\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --all               History of every ref and HEAD, in topological order\n");
+    fprintf(stderr, "  --refs GLOB         History of the refs matching GLOB (e.g. heads/*), in topological order\n");
+    fprintf(stderr, "  --file-cache-mb N   Memory for cached changed-file lists (default %d)\n", DEFAULT_FILE_CACHE_MB);
+    fprintf(stderr, "  --prefetch N        Commits diffed ahead of the cursor, 0 to disable (default %d)\n", DEFAULT_PREFETCH_DEPTH);
+    fprintf(stderr, "  --diff-limit-mb N   Patch text shown per file before truncating (default %d)\n", DEFAULT_DIFF_LIMIT_MB);
+    fprintf(stderr, "  --rename-limit N    Rename/copy candidates compared per file, 0 to disable (default %d)\n", DEFAULT_RENAME_LIMIT);
+    fprintf(stderr, "  --rename-ms N       Time per commit for inexact renames before exact only (default %d)\n", DEFAULT_RENAME_MS);
+    fprintf(stderr, "  --trace FILE        Write timed hot paths as a Chrome trace (chrome://tracing)\n");
+    fprintf(stderr, "  --bench             Run headless and print startup and per-key timings\n");
+    fprintf(stderr, "  --script FILE       Keys replayed by --bench (see README)\n");
+    fprintf(stderr, "  --stats csv|json    Print commits per author per month and the most changed files, then exit\n");
+}
+
+// Helper function to tell whether a job was superseded (never, without a token)
+bool diff_cancelled(const DiffCancel* cancel) {
+    return cancel && cancel->current->load() != cancel->generation;
+}
+
+// Callback function to abort a tree diff once its job is stale
+int diff_progress_callback(const git_diff* diff_so_far, const char* old_path,
+                           const char* new_path, void* payload) {
+    return diff_cancelled(static_cast<const DiffCancel*>(payload)) ? GIT_EUSER : 0;
+}
+
+// A patch being printed into a DiffText, with the job it belongs to
+struct PatchBuild {
+    DiffText* text;
+    const DiffCancel* cancel;
+};
+
+// Callback function to collect diff content into a DiffText; stops the
+// patch (by returning non-zero) once the byte limit is reached
+int diff_line_callback(const git_diff_delta *delta, const git_diff_hunk *hunk,
+                      const git_diff_line *line, void *payload) {
+    PatchBuild* build = static_cast<PatchBuild*>(payload);
+    DiffText* text = build->text;
+    if (diff_cancelled(build->cancel)) return GIT_EUSER;
+
+    // Content lines keep their +/-/space marker in the text, headers don't
+    char prefix = ' ';
+    bool marked = true;
+    switch (line->origin) {
+        case GIT_DIFF_LINE_ADDITION: prefix = '+'; break;
+        case GIT_DIFF_LINE_DELETION: prefix = '-'; break;
+        case GIT_DIFF_LINE_FILE_HDR: prefix = 'F'; marked = false; break;
+        case GIT_DIFF_LINE_HUNK_HDR: prefix = 'H'; marked = false; break;
+        case GIT_DIFF_LINE_BINARY: prefix = 'B'; marked = false; text->binary = true; break;
+        default: break;
+    }
+    if (delta->flags & GIT_DIFF_FLAG_BINARY) text->binary = true;
+
+    if (text->bytes.size() + line->content_len + 1 > text->limit) {
+        text->truncated = true;
+        return 1;
+    }
+
+    // Headers may span several lines (the file header is diff/index/---/+++)
+    const char* content = line->content;
+    const char* end = content + line->content_len;
+    if (end > content && end[-1] == '\n') end--;
+    do {
+        const char* newline = static_cast<const char*>(memchr(content, '\n', end - content));
+        const char* line_end = newline ? newline : end;
+        text->offsets.push_back(text->bytes.size());
+        text->origins.push_back(prefix);
+        if (marked) text->bytes.push_back(prefix);
+        text->bytes.append(content, line_end - content);
+        content = line_end + 1;
+    } while (content < end);
+    return 0;
+}
+
+// Helper functions to read a DiffText line by line
+size_t diff_line_count(const DiffText& text) {
+    return text.origins.size();
+}
+
+size_t diff_line_length(const DiffText& text, size_t i) {
+    size_t end = i + 1 < text.offsets.size() ? text.offsets[i + 1] : text.bytes.size();
+    return end - text.offsets[i];
+}
+
+// Rows the diff pane can scroll through: the lines plus a truncation notice
+int diff_row_count(const shared_ptr<const DiffText>& text) {
+    if (!text) return 0;
+    return diff_line_count(*text) + (text->truncated ? 1 : 0);
+}
+
+const Language LANGUAGES[] = {
+    {"c h cc cpp cxx hpp hh hxx inl ino",
+     "auto bool break case catch char class const constexpr continue decltype default delete do double else "
+     "enum explicit extern false final float for friend goto if inline int long mutable namespace new noexcept "
+     "nullptr operator override private protected public register return short signed sizeof static "
+     "static_cast dynamic_cast reinterpret_cast const_cast struct switch template this throw true try typedef "
+     "typename union unsigned using virtual void volatile while NULL size_t int8_t int16_t int32_t int64_t "
+     "uint8_t uint16_t uint32_t uint64_t",
+     "//", "/*", "*/", "\"'", false, false, true},
+    {"py pyw pyi",
+     "and as assert async await break class continue def del elif else except False finally for from global "
+     "if import in is lambda None nonlocal not or pass raise return self True try while with yield",
+     "#", NULL, NULL, "\"'", true, false, false},
+    {"js jsx mjs cjs ts tsx",
+     "async await break case catch class const continue debugger default delete do else enum export extends "
+     "false finally for function if implements import in instanceof interface let new null of private "
+     "protected public readonly return static super switch this throw true try type typeof undefined var void "
+     "while with yield",
+     "//", "/*", "*/", "\"'", false, true, false},
+    {"go",
+     "bool break byte case chan const continue default defer else error fallthrough false for func go goto if "
+     "import int int64 interface map nil package range return rune select string struct switch true type "
+     "uint uint64 var",
+     "//", "/*", "*/", "\"'", false, true, false},
+    {"rs",
+     "as async await break const continue crate dyn else enum Err extern false fn for if impl in let loop "
+     "match mod move mut None Ok pub ref return self Self Some static struct super trait true type unsafe use "
+     "where while",
+     "//", "/*", "*/", "\"", false, false, false},
+    {"java kt kts cs scala swift",
+     "abstract boolean break byte case catch char class const continue default do double else enum extends "
+     "false final finally float for fun func if implements import in instanceof int interface internal let "
+     "long namespace native new null override package private protected public return short static string "
+     "super switch synchronized this throw throws true try using val var void volatile while",
+     "//", "/*", "*/", "\"'", false, false, false},
+    {"sh bash zsh",
+     "case do done elif else esac export fi for function if in local readonly return then until while",
+     "#", NULL, NULL, "\"'", false, false, false},
+};
+
+// Helper function to pick the language of a path by its extension
+const Language* find_language(const string& path) {
+    size_t dot = path.rfind('.');
+    if (dot == string::npos || path.find('/', dot) != string::npos) return NULL;
+    string extension = path.substr(dot + 1);
+    for (const Language& language : LANGUAGES) {
+        for (const char* p = language.extensions; *p;) {
+            size_t length = strcspn(p, " ");
+            if (extension.compare(0, string::npos, p, length) == 0) return &language;
+            p += length + (p[length] == ' ');
+        }
+    }
+    return NULL;
+}
+
+// Character classes of the tokenizer
+enum CharClass : uint8_t { CHAR_OTHER, CHAR_SPACE, CHAR_IDENT, CHAR_DIGIT };
+
+const uint8_t* char_classes() {
+    static uint8_t table[256];
+    static bool built = [] {
+        for (int c = 0; c < 256; c++) {
+            table[c] = isdigit(c) ? CHAR_DIGIT : isalpha(c) || c == '_' || c >= 0x80 ? CHAR_IDENT
+                     : isspace(c) ? CHAR_SPACE : CHAR_OTHER;
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+// Helper function to tell whether an identifier is one of a language's
+// keywords; each language's list is split into a set on first use
+bool is_keyword(const Language& language, string_view word) {
+    static unordered_map<const Language*, unordered_set<string_view>> sets;
+    static mutex lock;
+    lock_guard<mutex> guard(lock);
+    auto it = sets.find(&language);
+    if (it == sets.end()) {
+        unordered_set<string_view> words;
+        for (const char* p = language.keywords; *p;) {
+            size_t length = strcspn(p, " ");
+            words.emplace(p, length);
+            p += length + (p[length] == ' ');
+        }
+        it = sets.emplace(&language, move(words)).first;
+    }
+    return it->second.count(word) > 0;
+}
+
+// Helper function to find where a construct spanning lines ends: the
+// offset past its closing delimiter, or npos if the line ends inside it
+size_t find_closing(const char* text, size_t length, size_t from, const char* close, bool escapes) {
+    size_t close_length = strlen(close);
+    for (size_t i = from; i + close_length <= length; i++) {
+        if (escapes && text[i] == '\\') {
+            i++;
+            continue;
+        }
+        if (memcmp(text + i, close, close_length) == 0) return i + close_length;
+    }
+    return string::npos;
+}
+
+// Table-driven tokenizer: splits one line into spans, starting in state and
+// returning the state the line leaves it in. Only the first
+// HIGHLIGHT_MAX_LINE bytes are read; a construct opening past them is missed.
+TokenState tokenize_line(const Language& language, const char* text, size_t length, TokenState state,
+                         vector<TokenSpan>& spans) {
+    const uint8_t* classes = char_classes();
+    length = min(length, (size_t)HIGHLIGHT_MAX_LINE);
+    auto emit = [&](size_t start, size_t end, TokenKind kind) {
+        if (end > start) spans.push_back({(uint16_t)start, (uint16_t)(end - start), kind});
+    };
+    size_t line_comment = language.line_comment ? strlen(language.line_comment) : 0;
+    size_t block_open = language.block_open ? strlen(language.block_open) : 0;
+
+    size_t i = 0;
+    while (i < length) {
+        // Inside a construct that spans lines: find its end, or take the line
+        if (state != STATE_NORMAL) {
+            const char* close = state == STATE_BLOCK_COMMENT ? language.block_close
+                              : state == STATE_TRIPLE_DOUBLE ? "\"\"\"" : state == STATE_TRIPLE_SINGLE ? "'''" : "`";
+            size_t end = find_closing(text, length, i, close, state != STATE_BLOCK_COMMENT);
+            emit(i, end == string::npos ? length : end, state == STATE_BLOCK_COMMENT ? TOKEN_COMMENT : TOKEN_STRING);
+            if (end == string::npos) return state;
+            state = STATE_NORMAL;
+            i = end;
+            continue;
+        }
+
+        unsigned char c = text[i];
+        if (language.preprocessor && c == '#' && text + i == text + strspn(text, " \t")) {
+            emit(i, length, TOKEN_PREPROCESSOR);
+            break;
+        }
+        if (line_comment && strncmp(text + i, language.line_comment, min(line_comment, length - i)) == 0 &&
+            length - i >= line_comment) {
+            emit(i, length, TOKEN_COMMENT);
+            break;
+        }
+        if (block_open && length - i >= block_open && memcmp(text + i, language.block_open, block_open) == 0) {
+            state = STATE_BLOCK_COMMENT;
+            size_t end = find_closing(text, length, i + block_open, language.block_close, false);
+            emit(i, end == string::npos ? length : end, TOKEN_COMMENT);
+            if (end == string::npos) return state;
+            state = STATE_NORMAL;
+            i = end;
+            continue;
+        }
+        if (language.triple_quotes && (c == '"' || c == '\'') && length - i >= 3 &&
+            text[i + 1] == c && text[i + 2] == c) {
+            state = c == '"' ? STATE_TRIPLE_DOUBLE : STATE_TRIPLE_SINGLE;
+            size_t end = find_closing(text, length, i + 3, c == '"' ? "\"\"\"" : "'''", true);
+            emit(i, end == string::npos ? length : end, TOKEN_STRING);
+            if (end == string::npos) return state;
+            state = STATE_NORMAL;
+            i = end;
+            continue;
+        }
+        if (language.backtick_strings && c == '`') {
+            size_t end = find_closing(text, length, i + 1, "`", true);
+            emit(i, end == string::npos ? length : end, TOKEN_STRING);
+            if (end == string::npos) return STATE_BACKTICK;
+            i = end;
+            continue;
+        }
+        if (strchr(language.quotes, c) && c) {
+            char quote[2] = {(char)c, 0};
+            size_t end = find_closing(text, length, i + 1, quote, true);
+            emit(i, end == string::npos ? length : end, TOKEN_STRING);
+            if (end == string::npos) break;
+            i = end;
+            continue;
+        }
+
+        size_t start = i;
+        switch (classes[c]) {
+            case CHAR_DIGIT:
+                while (i < length && (classes[(unsigned char)text[i]] >= CHAR_IDENT || text[i] == '.')) i++;
+                emit(start, i, TOKEN_NUMBER);
+                break;
+            case CHAR_IDENT:
+                while (i < length && classes[(unsigned char)text[i]] >= CHAR_IDENT) i++;
+                if (is_keyword(language, string_view(text + start, i - start))) emit(start, i, TOKEN_KEYWORD);
+                break;
+            default:
+                i++;
+        }
+    }
+    return state;
+}
+
+// Helper function to tokenize one blob line, through the cache when the
+// blob is known (a zero oid, like a file only on disk, is never cached)
+const LineTokens& blob_line_tokens(HighlightCache& cache, const Language& language, const git_oid& blob,
+                                   uint32_t line, const char* text, size_t length, TokenState state,
+                                   LineTokens& scratch) {
+    LineTokens* tokens = &scratch;
+    if (!git_oid_is_zero(&blob)) {
+        auto it = cache.index.find(blob);
+        if (it == cache.index.end()) {
+            cache.blobs.push_front(BlobTokens());
+            cache.blobs.front().oid = blob;
+            it = cache.index.emplace(blob, cache.blobs.begin()).first;
+        } else if (it->second != cache.blobs.begin()) {
+            cache.blobs.splice(cache.blobs.begin(), cache.blobs, it->second);
+        }
+        auto inserted = it->second->lines.emplace(line, LineTokens());
+        tokens = &inserted.first->second;
+        if (!inserted.second && tokens->state_in == state) return *tokens;
+        if (inserted.second) cache.lines++;
+    }
+    tokens->state_in = state;
+    tokens->spans.clear();
+    tokens->state_out = tokenize_line(language, text, length, state, tokens->spans);
+    return *tokens;
+}
+
+// Helper function to drop the least recently used blobs past the budget,
+// never the one in use
+void trim_highlight_cache(HighlightCache& cache) {
+    while (cache.lines > HIGHLIGHT_CACHE_LINES && cache.blobs.size() > 1) {
+        cache.lines -= cache.blobs.back().lines.size();
+        cache.index.erase(cache.blobs.back().oid);
+        cache.blobs.pop_back();
+    }
+}
+
+// Helper function to tokenize diff line i from position at and move at past
+// it. Hunk headers restart both sides at their line numbers; a construct
+// left open before a hunk is not known, so each hunk starts in plain code.
+// spans, when given, receives the line's tokens.
+void advance_highlight(DiffHighlight& highlight, HighlightCache& cache, size_t i, HighlightPosition& at,
+                       vector<TokenSpan>* spans) {
+    const DiffText& text = *highlight.text;
+    char origin = text.origins[i];
+    const char* line = text.bytes.data() + text.offsets[i];
+    size_t length = diff_line_length(text, i);
+    if (origin == 'H') {
+        // Lines are not terminated, so the header is parsed from a copy
+        char header[64];
+        snprintf(header, sizeof(header), "%.*s", (int)min(length, sizeof(header) - 1), line);
+        unsigned old_start = 0, new_start = 0;
+        sscanf(header, "@@ -%u%*[^+]+%u", &old_start, &new_start);
+        at.old_line = old_start;
+        at.new_line = new_start;
+        at.old_state = at.new_state = STATE_NORMAL;
+        return;
+    }
+    if (origin == 'F' || origin == 'B') {
+        at = HighlightPosition();
+        return;
+    }
+    if (!highlight.language || length == 0) return;
+
+    // Content lines carry their marker; tokens start after it
+    LineTokens scratch;
+    const Language& language = *highlight.language;
+    bool old_side = origin == '-';
+    const git_oid& blob = old_side ? highlight.old_id : highlight.new_id;
+    uint32_t& number = old_side ? at.old_line : at.new_line;
+    TokenState& state = old_side ? at.old_state : at.new_state;
+    const LineTokens& tokens = blob_line_tokens(cache, language, blob, number, line + 1, length - 1, state, scratch);
+    if (spans) *spans = tokens.spans;
+    state = tokens.state_out;
+    number++;
+    if (origin == ' ') {
+        // A context line is in both blobs; the old side only needs its state
+        if (at.old_state != tokens.state_in) {
+            vector<TokenSpan> ignored;
+            at.old_state = tokenize_line(language, line + 1, length - 1, at.old_state, ignored);
+        } else {
+            at.old_state = tokens.state_out;
+        }
+        at.old_line++;
+    }
+}
+
+// Helper function to find the tokens of the diff rows [begin, end) of the
+// shown diff, starting over when the diff changed. Checkpoints are saved up
+// to begin; the rows are then replayed from the nearest one.
+void highlight_diff_rows(DiffHighlight& highlight, HighlightCache& cache, const DiffContent& content,
+                         const string& path, int begin, int end, vector<vector<TokenSpan>>& rows) {
+    ScopedTimer timer(TIMER_HIGHLIGHT);
+    if (highlight.text != content.text) {
+        highlight.text = content.text;
+        highlight.language = find_language(path);
+        highlight.old_id = content.old_id;
+        highlight.new_id = content.new_id;
+        highlight.checkpoints.assign(1, HighlightPosition());
+    }
+    rows.assign(max(end - begin, 0), vector<TokenSpan>());
+    if (!highlight.text || !highlight.language) return;
+    end = min(end, (int)diff_line_count(*highlight.text));
+
+    size_t checkpoint = min((size_t)begin / HIGHLIGHT_CHECKPOINT_LINES, highlight.checkpoints.size() - 1);
+    HighlightPosition at = highlight.checkpoints[checkpoint];
+    for (size_t i = checkpoint * HIGHLIGHT_CHECKPOINT_LINES; (int)i < end; i++) {
+        if (i % HIGHLIGHT_CHECKPOINT_LINES == 0 && i / HIGHLIGHT_CHECKPOINT_LINES == highlight.checkpoints.size())
+            highlight.checkpoints.push_back(at);
+        advance_highlight(highlight, cache, i, at, (int)i >= begin ? &rows[i - begin] : NULL);
+    }
+    trim_highlight_cache(cache);
+}
+
+// Helper function to find the change block of a '-' or '+' line
+ChangeBlock find_change_block(const string& origins, uint32_t line) {
+    ChangeBlock block;
+    uint32_t start = line;
+    while (start > 0 && origins[start - 1] == origins[line]) start--;
+    if (origins[line] == '+') {
+        block.plus_start = start;
+        block.minus_start = start;
+        while (block.minus_start > 0 && origins[block.minus_start - 1] == '-') block.minus_start--;
+    } else {
+        block.minus_start = start;
+        block.plus_start = line;
+        while (block.plus_start < origins.size() && origins[block.plus_start] == '-') block.plus_start++;
+    }
+    block.end = max(line + 1, block.plus_start);
+    while (block.end < origins.size() && origins[block.end] == '+') block.end++;
+    return block;
+}
+
+// Helper function to split a line into words: runs of identifier
+// characters, runs of whitespace, and single punctuation characters
+void split_words(const char* text, size_t length, vector<string_view>& words) {
+    const uint8_t* classes = char_classes();
+    words.clear();
+    for (size_t i = 0; i < length;) {
+        uint8_t kind = classes[(unsigned char)text[i]];
+        size_t start = i++;
+        if (kind == CHAR_SPACE) {
+            while (i < length && classes[(unsigned char)text[i]] == CHAR_SPACE) i++;
+        } else if (kind != CHAR_OTHER) {
+            while (i < length && classes[(unsigned char)text[i]] >= CHAR_IDENT) i++;
+        }
+        words.emplace_back(text + start, i - start);
+    }
+}
+
+// Myers' O(ND) diff of two word sequences, marking the words outside a
+// longest common subsequence, from index at of the flags. Gives up past
+// WORD_DIFF_MAX_EDITS edits.
+bool diff_words(const string_view* a, int n, const string_view* b, int m,
+                vector<bool>& a_changed, vector<bool>& b_changed, size_t at) {
+    int max_edits = min(n + m, WORD_DIFF_MAX_EDITS);
+    int offset = max_edits + 1;
+    vector<int> v(2 * max_edits + 3, 0);
+    vector<vector<int>> trace;
+    for (int d = 0; d <= max_edits; d++) {
+        trace.push_back(v);
+        for (int k = -d; k <= d; k += 2) {
+            bool down = k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]);
+            int x = down ? v[offset + k + 1] : v[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) x++, y++;
+            v[offset + k] = x;
+            if (x < n || y < m) continue;
+
+            // Walk the edits back from the end, marking each one
+            for (int e = d; e > 0; e--) {
+                const vector<int>& previous = trace[e];
+                int kk = x - y;
+                bool was_down = kk == -e || (kk != e && previous[offset + kk - 1] < previous[offset + kk + 1]);
+                int previous_x = previous[offset + (was_down ? kk + 1 : kk - 1)];
+                int previous_y = previous_x - (was_down ? kk + 1 : kk - 1);
+                if (was_down) b_changed[at + previous_y] = true;
+                else a_changed[at + previous_x] = true;
+                x = previous_x;
+                y = previous_y;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function to turn the changed words of a line into byte ranges,
+// joining neighbours
+void changed_ranges(const char* line, const vector<string_view>& words, const vector<bool>& changed,
+                    vector<WordRange>& ranges) {
+    for (size_t w = 0; w < words.size(); w++) {
+        if (!changed[w]) continue;
+        uint32_t start = words[w].data() - line;
+        if (!ranges.empty() && ranges.back().start + ranges.back().length == start) {
+            ranges.back().length += words[w].size();
+        } else {
+            ranges.push_back({start, (uint32_t)words[w].size()});
+        }
+    }
+}
+
+// Helper function to find the changed words of a removed line and the added
+// line paired with it. The common leading and trailing words are trimmed
+// before the diff, which usually leaves it little to do. A pair with no
+// word in common is left unmarked, as the whole line changed.
+void refine_line_pair(const DiffText& text, uint32_t minus, uint32_t plus,
+                      vector<WordRange>& minus_ranges, vector<WordRange>& plus_ranges) {
+    const char* a_line = text.bytes.data() + text.offsets[minus] + 1;
+    const char* b_line = text.bytes.data() + text.offsets[plus] + 1;
+    vector<string_view> a, b;
+    split_words(a_line, diff_line_length(text, minus) - 1, a);
+    split_words(b_line, diff_line_length(text, plus) - 1, b);
+
+    size_t prefix = 0;
+    while (prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix]) prefix++;
+    size_t suffix = 0;
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix &&
+           a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix]) suffix++;
+
+    int n = a.size() - prefix - suffix, m = b.size() - prefix - suffix;
+    vector<bool> a_changed(a.size(), false), b_changed(b.size(), false);
+    if (n + m > WORD_DIFF_MAX_TOKENS ||
+        !diff_words(a.data() + prefix, n, b.data() + prefix, m, a_changed, b_changed, prefix)) {
+        // Too far apart to diff by word: mark everything between the common ends
+        fill(a_changed.begin() + prefix, a_changed.end() - suffix, true);
+        fill(b_changed.begin() + prefix, b_changed.end() - suffix, true);
+    }
+    if (count(a_changed.begin(), a_changed.end(), false) == 0 &&
+        count(b_changed.begin(), b_changed.end(), false) == 0) return;
+    changed_ranges(a_line, a, a_changed, minus_ranges);
+    changed_ranges(b_line, b, b_changed, plus_ranges);
+}
+
+// Helper function to find the intraline changes of the diff lines
+// [begin, end), starting over when the diff changed. Each change block in
+// the range is refined only for its pairs in the range; a line refined
+// once keeps its ranges for as long as its diff is shown.
+void refine_diff_lines(DiffWords& words, const shared_ptr<const DiffText>& text, int begin, int end) {
+    ScopedTimer timer(TIMER_WORDS);
+    if (words.text != text) {
+        words.text = text;
+        words.lines.clear();
+    }
+    if (!text) return;
+    const string& origins = text->origins;
+    end = min(end, (int)origins.size());
+    for (int i = max(begin, 0); i < end; i++) {
+        if ((origins[i] != '-' && origins[i] != '+') || words.lines.count(i)) continue;
+        ChangeBlock block = find_change_block(origins, i);
+        uint32_t pairs = min(block.plus_start - block.minus_start, block.end - block.plus_start);
+        for (uint32_t line = max((uint32_t)i, block.minus_start); line < min((uint32_t)end, block.end); line++) {
+            if (words.lines.count(line)) continue;
+            bool minus = line < block.plus_start;
+            uint32_t k = line - (minus ? block.minus_start : block.plus_start);
+            if (k >= pairs) {
+                words.lines[line];   // Unpaired: the whole line is the change
+                continue;
+            }
+            uint32_t minus_line = block.minus_start + k, plus_line = block.plus_start + k;
+            refine_line_pair(*text, minus_line, plus_line, words.lines[minus_line], words.lines[plus_line]);
+        }
+        i = block.end - 1;
+    }
+}
+
+// Helper function to index the side-by-side rows of a diff, once per diff
+void build_side_by_side(SideBySide& layout, const shared_ptr<const DiffText>& text) {
+    if (layout.text == text) return;
+    layout.text = text;
+    layout.blocks.clear();
+    layout.first_rows.clear();
+    layout.rows = 0;
+    if (!text) return;
+    const string& origins = text->origins;
+    uint32_t saved = 0;   // Rows saved by the pairs so far
+    for (size_t i = 0; i < origins.size();) {
+        size_t j = i;
+        while (j < origins.size() && origins[j] == '-') j++;
+        size_t k = j;
+        while (k < origins.size() && origins[k] == '+') k++;
+        if (j > i && k > j) {
+            layout.blocks.push_back({(uint32_t)i, (uint32_t)j, (uint32_t)k});
+            layout.first_rows.push_back(i - saved);
+            saved += min(j - i, k - j);
+        }
+        i = max(k, i + 1);
+    }
+    layout.rows = origins.size() - saved + (text->truncated ? 1 : 0);
+}
+
+// Helper function to find the lines shown on a side-by-side row: the old
+// side's and the new side's, -1 for none. A line that is not half of a
+// pair is on its own row; context and header lines are on both sides.
+void side_by_side_lines(const SideBySide& layout, int row, int& left, int& right) {
+    size_t b = upper_bound(layout.first_rows.begin(), layout.first_rows.end(), (uint32_t)row) -
+               layout.first_rows.begin();
+    int line = row;
+    if (b > 0) {
+        const ChangeBlock& block = layout.blocks[b - 1];
+        int k = row - layout.first_rows[b - 1];
+        int removed = block.plus_start - block.minus_start, added = block.end - block.plus_start;
+        if (k < max(removed, added)) {
+            left = k < removed ? block.minus_start + k : -1;
+            right = k < added ? block.plus_start + k : -1;
+            return;
+        }
+        line = row + (block.minus_start - layout.first_rows[b - 1]) + min(removed, added);
+    }
+    char origin = line < (int)layout.text->origins.size() ? layout.text->origins[line] : ' ';
+    left = origin == '+' ? -1 : line;
+    right = origin == '-' ? -1 : line;
+}
+
+// Helper function to find the side-by-side row of a diff line
+int side_by_side_row(const SideBySide& layout, int line) {
+    auto it = upper_bound(layout.blocks.begin(), layout.blocks.end(), (uint32_t)line,
+                          [](uint32_t value, const ChangeBlock& block) { return value < block.minus_start; });
+    if (it == layout.blocks.begin()) return line;
+    size_t b = it - layout.blocks.begin() - 1;
+    const ChangeBlock& block = layout.blocks[b];
+    uint32_t saved_before = block.minus_start - layout.first_rows[b];
+    if ((uint32_t)line < block.end) {
+        return layout.first_rows[b] + line - ((uint32_t)line < block.plus_start ? block.minus_start : block.plus_start);
+    }
+    return line - saved_before - min(block.plus_start - block.minus_start, block.end - block.plus_start);
+}
+
+// Helper function to find the screen column after printing byte c at
+// column x, as curses does: tabs go to the next stop, and the continuation
+// bytes of a UTF-8 character take no column of their own
+int next_column(char c, int x) {
+    if (c == '\t') return (x / TABSIZE + 1) * TABSIZE;
+    return (c & 0xC0) == 0x80 ? x : x + 1;
+}
+
+// Helper function to draw diff line i at column x of row y, clipped before
+// column right: colored by its origin, then its syntax tokens recolored
+// and its changed words reversed
+void draw_diff_line(WINDOW* window, int y, int x, int right, const DiffText& text, size_t i,
+                    const vector<TokenSpan>& spans, const vector<WordRange>* words) {
+    const char* line = text.bytes.data() + text.offsets[i];
+    int length = diff_line_length(text, i);
+    char origin = text.origins[i];
+    short line_pair = origin == '+' ? 1 : origin == '-' ? 2 : origin == ' ' ? 0 : 3;
+
+    // Only the bytes that fit are printed
+    int fits = 0;
+    for (int column = x; fits < length; fits++) {
+        int next = next_column(line[fits], column);
+        if (next > right) break;
+        column = next;
+    }
+    if (line_pair) wattron(window, COLOR_PAIR(line_pair));
+    mvwprintw(window, y, x, "%.*s", fits, line);
+    if (line_pair) wattroff(window, COLOR_PAIR(line_pair));
+
+    // Ranges are in bytes after the +/-/space marker; walk them over to columns
+    auto recolor = [&](int start, int end, attr_t attributes, short pair) {
+        start++;
+        end = min(end + 1, fits);
+        if (start >= end) return;
+        int from = x;
+        for (int b = 0; b < start; b++) from = next_column(line[b], from);
+        int to = from;
+        for (int b = start; b < end; b++) to = next_column(line[b], to);
+        if (to > from) mvwchgat(window, y, from, to - from, attributes, pair, NULL);
+    };
+    for (const TokenSpan& span : spans) {
+        attr_t attributes = span.kind == TOKEN_KEYWORD ? A_BOLD : span.kind == TOKEN_COMMENT ? A_DIM : A_NORMAL;
+        short pair = span.kind == TOKEN_STRING ? 3
+                   : span.kind == TOKEN_NUMBER || span.kind == TOKEN_PREPROCESSOR ? 6 : line_pair;
+        recolor(span.start, span.start + span.length, attributes, pair);
+    }
+    if (words) {
+        for (const WordRange& range : *words) {
+            recolor(range.start, range.start + range.length, A_REVERSE, line_pair);
+        }
+    }
+}
+
+// Rows the diff pane scrolls through: one per line unified, or as laid
+// out side by side when a layout is given
+int diff_pane_rows(SideBySide* layout, const shared_ptr<const DiffText>& text) {
+    if (!layout) return diff_row_count(text);
+    build_side_by_side(*layout, text);
+    return layout->rows;
+}
+
+// Helper function to look up (or create) the interned id of an author
+uint32_t intern_author(CommitStore& store, const string& name, const string& email) {
+    string key = name + '\0' + email;
+    auto it = store.author_ids.find(key);
+    if (it != store.author_ids.end()) return it->second;
+
+    uint32_t id = store.author_names.size();
+    store.author_names.push_back(name);
+    store.author_emails.push_back(email);
+    store.author_ids.emplace(key, id);
+    return id;
+}
+
+// Helper function to append one commit to the store
+void add_commit(CommitStore& store, const git_oid& oid, int64_t time,
+                const char* name, const char* email, const char* message,
+                const git_oid* parents, size_t parent_count) {
+    store.oids.push_back(oid);
+    store.parent_starts.push_back(store.parent_ids.size());
+    store.parent_ids.insert(store.parent_ids.end(), parents, parents + parent_count);
+    store.times.push_back(time);
+    store.authors.push_back(intern_author(store, name, email));
+    store.subjects.push_back(store.arena.size());
+    const char* end = strchr(message, '\n');
+    store.arena.append(message, end ? end - message : strlen(message));
+    store.arena.push_back('\0');
+}
+
+// Helper function to move every commit of src in front of those of dst,
+// remapping author ids and arena offsets. The arena is still only appended
+// to, so offsets already handed out stay valid.
+void prepend_commits(CommitStore& dst, CommitStore& src) {
+    if (dst.oids.empty()) {
+        swap(dst, src);
+        return;
+    }
+
+    vector<uint32_t> authors;
+    for (uint32_t author : src.authors)
+        authors.push_back(intern_author(dst, src.author_names[author], src.author_emails[author]));
+    uint32_t arena_base = dst.arena.size();
+    for (uint32_t& subject : src.subjects) subject += arena_base;
+    uint32_t parent_shift = src.parent_ids.size();
+    for (uint32_t& start : dst.parent_starts) start += parent_shift;
+
+    dst.oids.insert(dst.oids.begin(), src.oids.begin(), src.oids.end());
+    dst.times.insert(dst.times.begin(), src.times.begin(), src.times.end());
+    dst.authors.insert(dst.authors.begin(), authors.begin(), authors.end());
+    dst.subjects.insert(dst.subjects.begin(), src.subjects.begin(), src.subjects.end());
+    dst.parent_starts.insert(dst.parent_starts.begin(), src.parent_starts.begin(), src.parent_starts.end());
+    dst.parent_ids.insert(dst.parent_ids.begin(), src.parent_ids.begin(), src.parent_ids.end());
+    dst.arena.append(src.arena);
+    src = CommitStore();
+}
+
+// Helper function to move every commit of src onto the end of dst,
+// remapping author ids and arena offsets
+void append_commits(CommitStore& dst, CommitStore& src) {
+    if (dst.oids.empty()) {
+        swap(dst, src);
+        return;
+    }
+
+    vector<uint32_t> author_map(src.author_names.size());
+    for (size_t i = 0; i < src.author_names.size(); i++)
+        author_map[i] = intern_author(dst, src.author_names[i], src.author_emails[i]);
+
+    uint32_t arena_base = dst.arena.size();
+    dst.oids.insert(dst.oids.end(), src.oids.begin(), src.oids.end());
+    dst.times.insert(dst.times.end(), src.times.begin(), src.times.end());
+    for (uint32_t author : src.authors) dst.authors.push_back(author_map[author]);
+    for (uint32_t subject : src.subjects) dst.subjects.push_back(subject + arena_base);
+    uint32_t parent_base = dst.parent_ids.size();
+    for (uint32_t start : src.parent_starts) dst.parent_starts.push_back(start + parent_base);
+    dst.parent_ids.insert(dst.parent_ids.end(), src.parent_ids.begin(), src.parent_ids.end());
+    dst.arena.append(src.arena);
+    src = CommitStore();
+}
+
+// Helper functions to read one commit back out of the store
+const char* commit_subject(const CommitStore& store, size_t i) {
+    return store.arena.data() + store.subjects[i];
+}
+
+const string& commit_author(const CommitStore& store, size_t i) {
+    return store.author_names[store.authors[i]];
+}
+
+const string& commit_email(const CommitStore& store, size_t i) {
+    return store.author_emails[store.authors[i]];
+}
+
+// Helper function to find a commit's parents: *count of them from the
+// returned pointer on
+const git_oid* commit_parents(const CommitStore& store, size_t i, size_t* count) {
+    size_t end = i + 1 < store.parent_starts.size() ? store.parent_starts[i + 1] : store.parent_ids.size();
+    *count = end - store.parent_starts[i];
+    return store.parent_ids.data() + store.parent_starts[i];
+}
+
+// Helper function to map a history pane row to its commit when the pane
+// shows a filtered view
+int row_commit(const vector<int>* rows, int row) {
+    return rows ? (*rows)[row] : row;
+}
+
+// Helper function to lay out one history row: moves lanes past commit
+// row and, when glyphs is set, describes the row two cells per lane.
+// Codes: '*' the commit, '|' a passing lane, '-' and '+' a horizontal
+// line (crossing a lane), 'J'/'L' a lane joining the commit from the
+// right/left, '7'/'r' a lane opened for a merge parent on the right/left,
+// '<'/'>' a merge parent joining a lane already on the right/left,
+// '^'/'T' a horizontal line through a joining/opening lane.
+void advance_lanes(vector<git_oid>& lanes, const LaneGraph& graph, const CommitStore& store,
+                   size_t row, string* glyphs) {
+    static const git_oid free_lane = {};
+    const git_oid& oid = store.oids[row];
+    size_t count;
+    const git_oid* parents = commit_parents(store, row, &count);
+    auto drawn = [&](const git_oid& parent) {
+        auto it = graph.rows.find(parent);
+        return it != graph.rows.end() && it->second < row;
+    };
+
+    // The commit takes the first lane heading for it, else the first free one
+    size_t before = lanes.size();
+    size_t column = before;
+    for (size_t i = 0; i < before && column == before; i++) {
+        if (git_oid_equal(&lanes[i], &oid)) column = i;
+    }
+    if (column == before) {
+        for (size_t i = 0; i < before && column == before; i++) {
+            if (git_oid_is_zero(&lanes[i])) column = i;
+        }
+        if (column == before) lanes.push_back(free_lane);
+    }
+
+    string cells;
+    if (glyphs) {
+        cells.assign(2 * max(before, column + 1), ' ');
+        for (size_t i = 0; i < before; i++) {
+            if (!git_oid_is_zero(&lanes[i])) cells[2 * i] = '|';
+        }
+        cells[2 * column] = '*';
+    }
+    size_t left = column, right = column;   // Reach of the horizontal lines
+
+    // Any other lane heading for the commit ends here
+    for (size_t i = 0; i < before; i++) {
+        if (i == column || !git_oid_equal(&lanes[i], &oid)) continue;
+        lanes[i] = free_lane;
+        if (glyphs) cells[2 * i] = i > column ? 'J' : 'L';
+        left = min(left, i);
+        right = max(right, i);
+    }
+
+    // The first parent carries on in the commit's lane; merge parents join
+    // the lane already heading for them or open a new one, possibly in a
+    // lane that just joined the commit (drawn as a lane passing through)
+    lanes[column] = count > 0 && !drawn(parents[0]) ? parents[0] : free_lane;
+    for (size_t p = 1; p < count; p++) {
+        if (drawn(parents[p])) continue;
+        size_t target = lanes.size();
+        for (size_t i = 0; i < lanes.size() && target == lanes.size(); i++) {
+            if (git_oid_equal(&lanes[i], &parents[p])) target = i;
+        }
+        bool opened = target == lanes.size();
+        if (opened) {
+            for (size_t i = 0; i < lanes.size() && target == lanes.size(); i++) {
+                if (git_oid_is_zero(&lanes[i]) && i != column) target = i;
+            }
+            if (target == lanes.size()) lanes.push_back(free_lane);
+            lanes[target] = parents[p];
+        }
+        if (target == column) continue;
+        if (glyphs) {
+            if (2 * target >= cells.size()) cells.resize(2 * target + 2, ' ');
+            char& cell = cells[2 * target];
+            if (opened && cell == ' ') cell = target > column ? '7' : 'r';
+            else cell = target > column ? '<' : '>';
+        }
+        left = min(left, target);
+        right = max(right, target);
+    }
+
+    if (glyphs) {
+        for (size_t x = 2 * left + 1; x < 2 * right; x++) {
+            if (x == 2 * column) continue;
+            char& cell = cells[x];
+            if (cell == ' ') cell = '-';
+            else if (cell == '|' || cell == '<' || cell == '>') cell = '+';
+            else if (cell == 'J' || cell == 'L') cell = '^';
+            else if (cell == '7' || cell == 'r') cell = 'T';
+        }
+        *glyphs = cells;
+    }
+    while (!lanes.empty() && git_oid_is_zero(&lanes.back())) lanes.pop_back();
+}
+
+// Helper function to grow the lane layout to cover the first rows commits
+void extend_lane_graph(LaneGraph& graph, const CommitStore& store, size_t rows) {
+    for (; graph.rows_done < rows; graph.rows_done++) {
+        if (graph.rows_done % GRAPH_CHECKPOINT_ROWS == 0) graph.checkpoints.push_back(graph.lanes);
+        graph.rows.emplace(store.oids[graph.rows_done], graph.rows_done);
+        advance_lanes(graph.lanes, graph, store, graph.rows_done, NULL);
+    }
+}
+
+// Helper function to describe history rows [begin, end) of the graph,
+// replaying from the nearest checkpoint at or above begin
+void lane_graph_rows(LaneGraph& graph, const CommitStore& store, size_t begin, size_t end, vector<string>& rows) {
+    ScopedTimer timer(TIMER_GRAPH);
+    rows.assign(end - begin, string());
+    if (begin >= end) return;
+    extend_lane_graph(graph, store, end);
+    vector<git_oid> lanes = graph.checkpoints[begin / GRAPH_CHECKPOINT_ROWS];
+    for (size_t row = begin / GRAPH_CHECKPOINT_ROWS * GRAPH_CHECKPOINT_ROWS; row < end; row++)
+        advance_lanes(lanes, graph, store, row, row >= begin ? &rows[row - begin] : NULL);
+}
+
+// Helper function to draw one row of graph codes (see advance_lanes) with
+// line-drawing characters, cut off after GRAPH_MAX_LANES lanes
+void draw_graph_row(WINDOW* win, int y, int x, const string& glyphs) {
+    wattron(win, COLOR_PAIR(2));
+    wmove(win, y, x);
+    for (size_t i = 0; i < glyphs.size() && i < 2 * GRAPH_MAX_LANES - 1; i++) {
+        chtype ch = ' ';
+        switch (glyphs[i]) {
+            case '*': ch = '*' | A_BOLD; break;
+            case '|': ch = ACS_VLINE; break;
+            case '-': ch = ACS_HLINE; break;
+            case '+': ch = ACS_PLUS; break;
+            case 'J': ch = ACS_LRCORNER; break;
+            case 'L': ch = ACS_LLCORNER; break;
+            case '7': ch = ACS_URCORNER; break;
+            case 'r': ch = ACS_ULCORNER; break;
+            case '<': ch = ACS_RTEE; break;
+            case '>': ch = ACS_LTEE; break;
+            case '^': ch = ACS_BTEE; break;
+            case 'T': ch = ACS_TTEE; break;
+        }
+        waddch(win, ch);
+    }
+    wattroff(win, COLOR_PAIR(2));
+}
+
+// Helper function to list where a cache file may live: inside the git
+// directory, or under $XDG_CACHE_HOME when the repository is read-only
+vector<string> cache_file_paths(git_repository* repo, const char* file, const char* suffix) {
+    vector<string> paths;
+    string git_dir = git_repository_path(repo);
+    paths.push_back(git_dir + file);
+
+    string cache_home;
+    if (getenv("XDG_CACHE_HOME")) {
+        cache_home = getenv("XDG_CACHE_HOME");
+    } else if (getenv("HOME")) {
+        cache_home = string(getenv("HOME")) + "/.cache";
+    }
+    if (!cache_home.empty()) {
+        string key = git_dir;
+        for (char& c : key) {
+            if (c == '/') c = '%';
+        }
+        paths.push_back(cache_home + "/git-tui/" + key + suffix);
+    }
+    return paths;
+}
+
+vector<string> commit_index_paths(git_repository* repo, bool refs) {
+    return refs ? cache_file_paths(repo, REFS_INDEX_FILE, ".refs.idx")
+                : cache_file_paths(repo, COMMIT_INDEX_FILE, ".idx");
+}
+
+// Helper function to create the directories of a cache path under
+// $XDG_CACHE_HOME (git-tui/ and its parent)
+void make_cache_dirs(const string& path) {
+    string dir = path.substr(0, path.rfind('/'));
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+}
+
+// Helper function to take count records of size bytes off the remaining
+// length of a file; false when they do not fit (or the product overflows)
+bool take_section(uint64_t& remaining, uint64_t count, size_t size) {
+    if (count > remaining / size) return false;
+    remaining -= count * size;
+    return true;
+}
+
+// Helper function to check what a mapped index points at: author ids
+// within the author table, every string offset inside an arena that ends
+// with a NUL (so each string is terminated within it), and parent starts
+// that never decrease and never pass the parent list
+bool commit_index_consistent(const CommitIndex& index) {
+    const CommitIndexHeader* header = index.header;
+    uint64_t arena_size = header->arena_size;
+    if (header->count + header->author_count > 0 && (arena_size == 0 || index.arena[arena_size - 1] != '\0'))
+        return false;
+    for (uint64_t i = 0; i < header->author_count; i++) {
+        uint32_t offsets[2];
+        memcpy(offsets, index.author_table + i * sizeof(offsets), sizeof(offsets));
+        if (offsets[0] >= arena_size || offsets[1] >= arena_size) return false;
+    }
+    uint32_t previous_start = 0;
+    for (uint64_t i = 0; i < header->count; i++) {
+        uint32_t author, subject, start;
+        memcpy(&author, index.authors + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&subject, index.subjects + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&start, index.parent_starts + i * sizeof(uint32_t), sizeof(uint32_t));
+        if (author >= header->author_count || subject >= arena_size || start < previous_start ||
+            start > header->parent_count) {
+            return false;
+        }
+        previous_start = start;
+    }
+    return true;
+}
+
+// Helper function to map a commit index file, rejecting anything malformed
+bool open_commit_index(CommitIndex& index, const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CommitIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    // The sections must add up to the file size exactly, counted without
+    // trusting any header field not to overflow
+    const CommitIndexHeader* header = static_cast<const CommitIndexHeader*>(map);
+    uint64_t remaining = st.st_size - sizeof(CommitIndexHeader);
+    if (memcmp(header->magic, COMMIT_INDEX_MAGIC, sizeof(COMMIT_INDEX_MAGIC)) != 0 ||
+        header->version != COMMIT_INDEX_VERSION ||
+        !take_section(remaining, header->count, sizeof(git_oid) + sizeof(int64_t) + 3 * sizeof(uint32_t)) ||
+        !take_section(remaining, header->parent_count, sizeof(git_oid)) ||
+        !take_section(remaining, header->author_count, 2 * sizeof(uint32_t)) ||
+        !take_section(remaining, header->arena_size, 1) || remaining != 0) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    index.map = map;
+    index.map_size = st.st_size;
+    index.header = header;
+    index.oids = reinterpret_cast<const char*>(header + 1);
+    index.times = index.oids + header->count * sizeof(git_oid);
+    index.authors = index.times + header->count * sizeof(int64_t);
+    index.subjects = index.authors + header->count * sizeof(uint32_t);
+    index.parent_starts = index.subjects + header->count * sizeof(uint32_t);
+    index.parent_ids = index.parent_starts + header->count * sizeof(uint32_t);
+    index.author_table = index.parent_ids + header->parent_count * sizeof(git_oid);
+    index.arena = index.author_table + header->author_count * 2 * sizeof(uint32_t);
+    if (!commit_index_consistent(index)) {
+        munmap(map, st.st_size);
+        index = CommitIndex();
+        return false;
+    }
+    return true;
+}
+
+void close_commit_index(CommitIndex& index) {
+    if (index.map) munmap(index.map, index.map_size);
+    index = CommitIndex();
+}
+
+// Helper function to copy a mapped index into a store. Sections may be
+// unaligned in the file, so they are memcpy'd rather than dereferenced.
+void load_commit_index(const CommitIndex& index, CommitStore& store) {
+    size_t count = index.header->count;
+    store.oids.resize(count);
+    store.times.resize(count);
+    store.authors.resize(count);
+    store.subjects.resize(count);
+    store.parent_starts.resize(count);
+    store.parent_ids.resize(index.header->parent_count);
+    memcpy(store.oids.data(), index.oids, count * sizeof(git_oid));
+    memcpy(store.times.data(), index.times, count * sizeof(int64_t));
+    memcpy(store.authors.data(), index.authors, count * sizeof(uint32_t));
+    memcpy(store.subjects.data(), index.subjects, count * sizeof(uint32_t));
+    memcpy(store.parent_starts.data(), index.parent_starts, count * sizeof(uint32_t));
+    memcpy(store.parent_ids.data(), index.parent_ids, index.header->parent_count * sizeof(git_oid));
+    store.arena.assign(index.arena, index.header->arena_size);
+
+    for (uint64_t i = 0; i < index.header->author_count; i++) {
+        uint32_t offsets[2];
+        memcpy(offsets, index.author_table + i * sizeof(offsets), sizeof(offsets));
+        intern_author(store, index.arena + offsets[0], index.arena + offsets[1]);
+    }
+}
+
+// Helper function to write newly walked commits followed by the still valid
+// cached ones; goes through a temp file so readers never see a partial index
+bool write_commit_index(const string& path, const git_oid& tip,
+                        const CommitStore& fresh, const CommitIndex* cached) {
+    size_t cached_count = cached ? cached->header->count : 0;
+    size_t cached_authors = cached ? cached->header->author_count : 0;
+    size_t cached_arena = cached ? cached->header->arena_size : 0;
+    size_t cached_parents = cached ? cached->header->parent_count : 0;
+
+    // Fresh authors are appended after the cached author table and fresh
+    // strings after the cached arena, so only fresh ids and offsets move
+    vector<uint32_t> author_table;
+    string arena;
+    unordered_map<string, uint32_t> author_ids;
+    for (size_t i = 0; i < cached_authors; i++) {
+        uint32_t offsets[2];
+        memcpy(offsets, cached->author_table + i * sizeof(offsets), sizeof(offsets));
+        author_ids.emplace(string(cached->arena + offsets[0]) + '\0' + (cached->arena + offsets[1]), i);
+    }
+    vector<uint32_t> author_map(fresh.author_names.size());
+    for (size_t i = 0; i < fresh.author_names.size(); i++) {
+        string key = fresh.author_names[i] + '\0' + fresh.author_emails[i];
+        auto it = author_ids.find(key);
+        if (it != author_ids.end()) {
+            author_map[i] = it->second;
+            continue;
+        }
+        author_map[i] = cached_authors + author_table.size() / 2;
+        author_ids.emplace(key, author_map[i]);
+        author_table.push_back(cached_arena + fresh.arena.size() + arena.size());
+        arena.append(fresh.author_names[i].c_str(), fresh.author_names[i].size() + 1);
+        author_table.push_back(cached_arena + fresh.arena.size() + arena.size());
+        arena.append(fresh.author_emails[i].c_str(), fresh.author_emails[i].size() + 1);
+    }
+    vector<uint32_t> authors(fresh.authors.size());
+    vector<uint32_t> subjects(fresh.subjects.size());
+    for (size_t i = 0; i < fresh.authors.size(); i++) {
+        authors[i] = author_map[fresh.authors[i]];
+        subjects[i] = fresh.subjects[i] + cached_arena;
+    }
+
+    // Cached parents go after the fresh ones, so their starts move instead
+    vector<uint32_t> cached_starts(cached_count);
+    for (size_t i = 0; i < cached_count; i++) {
+        memcpy(&cached_starts[i], cached->parent_starts + i * sizeof(uint32_t), sizeof(uint32_t));
+        cached_starts[i] += fresh.parent_ids.size();
+    }
+
+    CommitIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMMIT_INDEX_MAGIC, sizeof(COMMIT_INDEX_MAGIC));
+    header.version = COMMIT_INDEX_VERSION;
+    header.count = fresh.oids.size() + cached_count;
+    header.author_count = cached_authors + author_table.size() / 2;
+    header.arena_size = cached_arena + fresh.arena.size() + arena.size();
+    header.parent_count = fresh.parent_ids.size() + cached_parents;
+    header.tip = tip;
+
+    string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) return false;
+    auto put = [&](const void* data, size_t size) {
+        return size == 0 || fwrite(data, 1, size, file) == size;
+    };
+    bool ok = put(&header, sizeof(header)) &&
+              put(fresh.oids.data(), fresh.oids.size() * sizeof(git_oid)) &&
+              put(cached ? cached->oids : NULL, cached_count * sizeof(git_oid)) &&
+              put(fresh.times.data(), fresh.times.size() * sizeof(int64_t)) &&
+              put(cached ? cached->times : NULL, cached_count * sizeof(int64_t)) &&
+              put(authors.data(), authors.size() * sizeof(uint32_t)) &&
+              put(cached ? cached->authors : NULL, cached_count * sizeof(uint32_t)) &&
+              put(subjects.data(), subjects.size() * sizeof(uint32_t)) &&
+              put(cached ? cached->subjects : NULL, cached_count * sizeof(uint32_t)) &&
+              put(fresh.parent_starts.data(), fresh.parent_starts.size() * sizeof(uint32_t)) &&
+              put(cached_starts.data(), cached_starts.size() * sizeof(uint32_t)) &&
+              put(fresh.parent_ids.data(), fresh.parent_ids.size() * sizeof(git_oid)) &&
+              put(cached ? cached->parent_ids : NULL, cached_parents * sizeof(git_oid)) &&
+              put(cached ? cached->author_table : NULL, cached_authors * 2 * sizeof(uint32_t)) &&
+              put(author_table.data(), author_table.size() * sizeof(uint32_t)) &&
+              put(cached ? cached->arena : NULL, cached_arena) &&
+              put(fresh.arena.data(), fresh.arena.size()) &&
+              put(arena.data(), arena.size());
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Helper function to let libgit2 answer revwalk queries from the
+// commit-graph file instead of inflating commit objects, when there is one
+void use_commit_graph(git_repository* repo) {
+    git_odb* odb = NULL;
+    git_commit_graph* graph = NULL;
+    if (git_repository_odb(&odb, repo) < 0) return;
+
+    // Takes the objects directory and looks in info/commit-graph below it
+    string objects_dir = string(git_repository_path(repo)) + "objects";
+    if (git_commit_graph_open(&graph, objects_dir.c_str()) == 0) {
+        // On success the odb takes ownership of the graph
+        if (git_odb_set_commit_graph(odb, graph) < 0) git_commit_graph_free(graph);
+    } else {
+        git_error_clear();   // No commit-graph file is not an error
+    }
+    git_odb_free(odb);
+}
+
+// Helper function to look up the entry for the path component at depth in
+// a tree; a zero oid when the tree is missing, isn't a tree, or has no
+// such entry
+git_oid tree_child(git_repository* repo, PathFilter& filter, size_t depth, const git_oid& tree_id) {
+    git_oid child;
+    memset(&child, 0, sizeof(child));
+    if (git_oid_is_zero(&tree_id)) return child;
+
+    auto& seen = filter.children[depth];
+    auto it = seen.find(tree_id);
+    if (it != seen.end()) return it->second;
+
+    git_tree* tree = NULL;
+    if (git_tree_lookup(&tree, repo, &tree_id) == 0) {
+        const git_tree_entry* entry = git_tree_entry_byname(tree, filter.components[depth].c_str());
+        if (entry) git_oid_cpy(&child, git_tree_entry_id(entry));
+        git_tree_free(tree);
+    }
+    if (++filter.memo_entries > PATH_MEMO_ENTRIES) {
+        for (auto& level : filter.children) level.clear();
+        filter.memo_entries = 1;
+    }
+    seen.emplace(tree_id, child);
+    return child;
+}
+
+// Helper function to tell whether the path resolves to different objects in
+// two trees. Both are descended one component at a time, and the walk stops
+// as soon as both sides hold the same oid: an unchanged directory is never read.
+bool path_differs(git_repository* repo, PathFilter& filter, git_oid a, git_oid b) {
+    for (size_t depth = 0; depth < filter.components.size(); depth++) {
+        if (git_oid_equal(&a, &b)) return false;
+        a = tree_child(repo, filter, depth, a);
+        b = tree_child(repo, filter, depth, b);
+    }
+    return !git_oid_equal(&a, &b);
+}
+
+// Helper function to tell whether a commit changed the path. As in git log,
+// a merge only counts when the path differs from every parent.
+bool commit_touches_path(git_repository* repo, PathFilter& filter, git_commit* commit) {
+    const git_oid* tree = git_commit_tree_id(commit);
+    unsigned int parents = git_commit_parentcount(commit);
+    if (parents == 0) {
+        git_oid empty;
+        memset(&empty, 0, sizeof(empty));
+        return path_differs(repo, filter, empty, *tree);
+    }
+    for (unsigned int i = 0; i < parents; i++) {
+        git_commit* parent = NULL;
+        if (git_commit_parent(&parent, commit, i) < 0) continue;
+        bool differs = path_differs(repo, filter, *git_commit_tree_id(parent), *tree);
+        git_commit_free(parent);
+        if (!differs) return false;
+    }
+    return true;
+}
+
+// Helper function to split a repository-relative path into its components,
+// ignoring "." and empty ones (leading "./", trailing or doubled slashes)
+vector<string> path_components(const string& path) {
+    vector<string> components;
+    stringstream ss(path);
+    string name;
+    while (getline(ss, name, '/')) {
+        if (!name.empty() && name != ".") components.push_back(name);
+    }
+    return components;
+}
+
+// Helper function to read where the history starts: HEAD, or the refs
+// matching glob (and HEAD with with_head), sorted by name
+int read_history_tips(git_repository* repo, const string& glob, bool with_head, vector<RefTip>& tips) {
+    tips.clear();
+    git_oid head;
+    if (glob.empty() || with_head) {
+        int error = git_reference_name_to_id(&head, repo, "HEAD");
+        if (error < 0 && glob.empty()) return error;
+        if (error == 0) tips.push_back({"HEAD", head});
+    }
+    if (glob.empty()) return 0;
+
+    git_reference_iterator* iter = NULL;
+    git_reference* ref = NULL;
+    int error = git_reference_iterator_glob_new(&iter, repo, glob.c_str());
+    if (error < 0) return error;
+    while (git_reference_next(&ref, iter) == 0) {
+        git_oid id;
+        if (git_reference_type(ref) == GIT_REFERENCE_DIRECT) {
+            tips.push_back({git_reference_name(ref), *git_reference_target(ref)});
+        } else if (git_reference_name_to_id(&id, repo, git_reference_name(ref)) == 0) {
+            tips.push_back({git_reference_name(ref), id});
+        }
+        git_reference_free(ref);
+    }
+    git_reference_iterator_free(iter);
+    if (tips.empty()) {
+        git_error_clear();
+        return GIT_ENOTFOUND;
+    }
+    sort(tips.begin(), tips.end(), [](const RefTip& a, const RefTip& b) { return a.name < b.name; });
+    return 0;
+}
+
+// Helper function to fingerprint a walk of refs into one oid, which stands
+// in for the commit index's tip: any ref that moves voids the index
+void fingerprint_tips(const string& glob, const vector<RefTip>& tips, git_oid* digest) {
+    string text = glob;
+    for (const RefTip& tip : tips) {
+        text += '\n';
+        text += tip.name;
+        text += ' ';
+        text += git_oid_tostr_s(&tip.oid);
+    }
+    git_odb_hash(digest, text.data(), text.size(), GIT_OBJECT_BLOB);
+}
+
+// Helper function to find a ref among tips sorted by name, or NULL
+const RefTip* find_tip(const vector<RefTip>& tips, const string& name) {
+    auto it = lower_bound(tips.begin(), tips.end(), name, [](const RefTip& tip, const string& name) {
+        return tip.name < name;
+    });
+    return it != tips.end() && it->name == name ? &*it : NULL;
+}
+
+// Helper function to label every commit a ref points at: HEAD first, then
+// branches, remote branches, tags and anything else, like git log --decorate.
+// The result is sorted by oid for lookup_decoration.
+vector<Decoration> load_decorations(git_repository* repo) {
+    struct Named {
+        git_oid oid;
+        int rank;
+        string name;
+    };
+    vector<Named> names;
+    string head_name;
+    git_reference* head = NULL;
+    if (git_repository_head(&head, repo) == 0) {
+        head_name = git_reference_name(head);
+        if (head_name == "HEAD") names.push_back({*git_reference_target(head), 0, "HEAD"});   // Detached
+        git_reference_free(head);
+    }
+
+    git_reference_iterator* iter = NULL;
+    git_reference* ref = NULL;
+    if (git_reference_iterator_new(&iter, repo) == 0) {
+        while (git_reference_next(&ref, iter) == 0) {
+            git_object* target = NULL;
+            if (git_reference_type(ref) == GIT_REFERENCE_DIRECT &&
+                git_reference_peel(&target, ref, GIT_OBJECT_COMMIT) == 0) {
+                string name = git_reference_shorthand(ref);
+                int rank = 4;
+                if (git_reference_is_branch(ref)) {
+                    rank = 1;
+                    if (head_name == git_reference_name(ref)) {
+                        name = "HEAD -> " + name;
+                        rank = 0;
+                    }
+                } else if (git_reference_is_remote(ref)) {
+                    rank = 2;
+                } else if (git_reference_is_tag(ref)) {
+                    name = "tag: " + name;
+                    rank = 3;
+                }
+                names.push_back({*git_object_id(target), rank, name});
+                git_object_free(target);
+            }
+            git_reference_free(ref);
+        }
+        git_reference_iterator_free(iter);
+    }
+
+    sort(names.begin(), names.end(), [](const Named& a, const Named& b) {
+        int order = git_oid_cmp(&a.oid, &b.oid);
+        return order != 0 ? order < 0 : a.rank != b.rank ? a.rank < b.rank : a.name < b.name;
+    });
+    vector<Decoration> decorations;
+    for (const Named& named : names) {
+        if (!decorations.empty() && git_oid_equal(&decorations.back().oid, &named.oid)) {
+            decorations.back().label += ", " + named.name;
+        } else {
+            decorations.push_back({named.oid, named.name});
+        }
+    }
+    return decorations;
+}
+
+// Helper function to find the label of a commit, or NULL
+const string* lookup_decoration(const vector<Decoration>& decorations, const git_oid& oid) {
+    auto it = lower_bound(decorations.begin(), decorations.end(), oid, [](const Decoration& d, const git_oid& oid) {
+        return git_oid_cmp(&d.oid, &oid) < 0;
+    });
+    return it != decorations.end() && git_oid_equal(&it->oid, &oid) ? &it->label : NULL;
+}
+
+// Helper function to hand the ref labels over to the UI thread. Peeling
+// thousands of tags takes a while, so this waits for the first commits.
+bool publish_decorations(CommitLoader* loader, git_repository* repo) {
+    vector<Decoration> decorations = load_decorations(repo);
+    lock_guard<mutex> guard(loader->lock);
+    loader->decorations.swap(decorations);
+    loader->decorations_ready = true;
+    return true;
+}
+
+// Helper function to hand a batch of commits over to the UI thread
+void flush_commit_batch(CommitLoader* loader, CommitStore& batch) {
+    lock_guard<mutex> guard(loader->lock);
+    append_commits(loader->pending, batch);
+}
+
+// Worker thread: walks history with its own repository handle and hands
+// commit batches over to the UI thread through loader->pending.
+// Commits already in the on-disk index are read from it instead of being
+// parsed again; only commits newer than the cached tip are walked.
+// A path-limited walk filters every commit and bypasses the index.
+// With refs set, the walk starts from many refs in topological order; its
+// index is only reused while no ref has moved.
+void commit_loader_run(CommitLoader* loader) {
+    name_trace_thread("history walk");
+    git_repository* repo = NULL;
+    git_revwalk* walker = NULL;
+    git_commit* commit = NULL;
+    git_oid head;   // Or, walking refs, the fingerprint of their tips
+    bool refs_mode = !loader->refs.empty();
+    vector<RefTip> tips;
+
+    if (git_repository_open(&repo, loader->repo_path.c_str()) < 0 ||
+        git_revwalk_new(&walker, repo) < 0 ||
+        read_history_tips(repo, loader->refs, loader->with_head, tips) < 0 ||
+        (!refs_mode && git_revwalk_push(walker, &tips[0].oid) < 0)) {
+        const git_error* e = git_error_last();
+        lock_guard<mutex> guard(loader->lock);
+        loader->error = e ? e->message : refs_mode ? "no refs match " + loader->refs : "unable to walk history";
+        if (walker) git_revwalk_free(walker);
+        if (repo) git_repository_free(repo);
+        loader->done = true;
+        return;
+    }
+    use_commit_graph(repo);
+    if (refs_mode) {
+        fingerprint_tips(loader->refs, tips, &head);
+    } else {
+        head = tips[0].oid;
+    }
+    loader->tips = tips;
+
+    PathFilter filter;
+    filter.components = path_components(loader->path);
+    filter.children.resize(filter.components.size());
+    bool path_limited = !filter.components.empty();
+
+    // The cache is usable if HEAD is its tip or has only moved forward from
+    // it; a topological walk of refs is redone as soon as anything moved
+    vector<string> index_paths = commit_index_paths(repo, refs_mode);
+    CommitIndex cached;
+    for (const string& path : index_paths) {
+        if (path_limited || open_commit_index(cached, path)) break;
+    }
+    bool cache_valid = false;
+    bool cache_current = false;
+    if (cached.header) {
+        cache_current = git_oid_equal(&cached.header->tip, &head);
+        cache_valid = cache_current || (!refs_mode && git_graph_descendant_of(repo, &head, &cached.header->tip) == 1);
+        if (!cache_valid) close_commit_index(cached);
+    }
+
+    // Fresh commits are kept whole for the index writer; batch is what the
+    // UI has not been handed yet
+    CommitStore fresh;
+    CommitStore batch;
+    auto last_flush = chrono::steady_clock::now();
+    bool decorated = false;   // Ref labels are handed over after the first commits
+
+    if (!cache_current) {
+        if (cache_valid) git_revwalk_hide(walker, &cached.header->tip);
+        if (refs_mode) {
+            // Pushed only now: with thousands of refs, a current index skips this
+            git_revwalk_push_glob(walker, loader->refs.c_str());
+            if (loader->with_head) git_revwalk_push_head(walker);
+        }
+
+        // GIT_SORT_TIME makes libgit2 walk the whole graph before returning the
+        // first commit; the unsorted walk already pops by commit date and streams.
+        // Refs get a topological order, which cannot be had without that full
+        // pass; batches stream from the first commit it returns.
+        git_revwalk_sorting(walker, refs_mode ? GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME : GIT_SORT_NONE);
+
+        git_oid oid;
+        vector<git_oid> parents;
+        while (!loader->stop && git_revwalk_next(&oid, walker) == 0) {
+            loader->walked++;
+            if (git_commit_lookup(&commit, repo, &oid) == 0) {
+                if (!path_limited || commit_touches_path(repo, filter, commit)) {
+                    const git_signature* author = git_commit_author(commit);
+                    const char* message = git_commit_message(commit);
+                    parents.resize(git_commit_parentcount(commit));
+                    for (size_t p = 0; p < parents.size(); p++) parents[p] = *git_commit_parent_id(commit, p);
+                    add_commit(fresh, oid, git_commit_time(commit), author->name, author->email, message,
+                               parents.data(), parents.size());
+                    add_commit(batch, oid, git_commit_time(commit), author->name, author->email, message,
+                               parents.data(), parents.size());
+                }
+                git_commit_free(commit);
+            }
+
+            // Flush on size, or on time so the first screen shows up right away
+            auto now = chrono::steady_clock::now();
+            if (batch.oids.size() >= COMMIT_BATCH_SIZE ||
+                now - last_flush >= chrono::milliseconds(COMMIT_BATCH_MS)) {
+                record_timing(TIMER_REVWALK, last_flush, now);
+                flush_commit_batch(loader, batch);
+                if (!decorated) decorated = publish_decorations(loader, repo);
+                last_flush = now;
+            }
+        }
+        record_timing(TIMER_REVWALK, last_flush, chrono::steady_clock::now());
+        flush_commit_batch(loader, batch);
+    }
+
+    // Everything below the cached tip comes straight from the mapped index
+    if (cached.header && !loader->stop) {
+        {
+            ScopedTimer timer(TIMER_INDEX_LOAD);
+            load_commit_index(cached, batch);
+        }
+        flush_commit_batch(loader, batch);
+        if (!decorated) decorated = publish_decorations(loader, repo);
+    }
+
+    // Persist the index unless it was already current, the walk was cut
+    // short, or it only holds the commits of one path
+    if (!cache_current && !loader->stop && !path_limited) {
+        for (const string& path : index_paths) {
+            if (path != index_paths.front()) make_cache_dirs(path);
+            if (write_commit_index(path, head, fresh, cached.header ? &cached : NULL)) break;
+        }
+    }
+
+    if (!decorated) publish_decorations(loader, repo);
+    close_commit_index(cached);
+    git_revwalk_free(walker);
+    git_repository_free(repo);
+    loader->done = true;
+}
+
+// Helper function to start the background history walk, or to walk again
+// with a loader that has finished
+void start_commit_loader(CommitLoader& loader, const char* repo_path, const string& path,
+                         const string& refs, bool with_head) {
+    loader.repo_path = repo_path;
+    loader.path = path;
+    loader.refs = refs;
+    loader.with_head = with_head;
+    loader.walked = 0;
+    loader.error.clear();
+    loader.done = false;
+    loader.stop = false;
+    loader.worker = thread(commit_loader_run, &loader);
+}
+
+// Helper function to move any commits loaded so far into the commit list,
+// and the ref labels once they are ready
+size_t drain_commit_loader(CommitLoader& loader, CommitStore& commitList, vector<Decoration>& decorations) {
+    CommitStore batch;
+    {
+        lock_guard<mutex> guard(loader.lock);
+        swap(batch, loader.pending);
+        if (loader.decorations_ready) {
+            decorations.swap(loader.decorations);
+            loader.decorations_ready = false;
+        }
+    }
+    size_t count = batch.oids.size();
+    append_commits(commitList, batch);
+    return count;
+}
+
+// Worker thread: reads the refs again and, if every one that moved only
+// moved forward, walks the commits between their old and new tips. New
+// refs are walked down to the listed history; deleted ones are left be.
+// The walk sorts like the full one, so the new commits go on top.
+void history_refresh_run(HistoryRefresh* refresh) {
+    name_trace_thread("history refresh");
+    git_repository* repo = NULL;
+    git_revwalk* walker = NULL;
+    if (git_repository_open(&repo, refresh->repo_path.c_str()) < 0 ||
+        git_revwalk_new(&walker, repo) < 0 ||
+        read_history_tips(repo, refresh->refs, refresh->with_head, refresh->tips) < 0) {
+        const git_error* e = git_error_last();
+        refresh->error = e ? e->message : "unable to read refs";
+        if (walker) git_revwalk_free(walker);
+        if (repo) git_repository_free(repo);
+        refresh->done = true;
+        return;
+    }
+    use_commit_graph(repo);
+
+    bool refs_mode = !refresh->refs.empty();
+    size_t pushed = 0;
+    for (const RefTip& tip : refresh->tips) {
+        const RefTip* old = find_tip(refresh->old_tips, tip.name);
+        if (old && git_oid_equal(&old->oid, &tip.oid)) continue;
+        if (old && git_graph_descendant_of(repo, &tip.oid, &old->oid) != 1) {
+            refresh->reload = true;
+            break;
+        }
+        git_revwalk_push(walker, &tip.oid);
+        pushed++;
+    }
+
+    if (pushed && !refresh->reload) {
+        ScopedTimer timer(TIMER_REVWALK);
+        for (const RefTip& old : refresh->old_tips) git_revwalk_hide(walker, &old.oid);
+        git_revwalk_sorting(walker, refs_mode ? GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME : GIT_SORT_NONE);
+
+        PathFilter filter;
+        filter.components = path_components(refresh->path);
+        filter.children.resize(filter.components.size());
+        bool path_limited = !filter.components.empty();
+        git_oid oid;
+        git_commit* commit = NULL;
+        vector<git_oid> parents;
+        while (git_revwalk_next(&oid, walker) == 0) {
+            if (git_commit_lookup(&commit, repo, &oid) < 0) continue;
+            if (!path_limited || commit_touches_path(repo, filter, commit)) {
+                const git_signature* author = git_commit_author(commit);
+                parents.resize(git_commit_parentcount(commit));
+                for (size_t p = 0; p < parents.size(); p++) parents[p] = *git_commit_parent_id(commit, p);
+                add_commit(refresh->commits, oid, git_commit_time(commit), author->name, author->email,
+                           git_commit_message(commit), parents.data(), parents.size());
+            }
+            git_commit_free(commit);
+        }
+    }
+
+    refresh->decorations = load_decorations(repo);
+    git_revwalk_free(walker);
+    git_repository_free(repo);
+    refresh->done = true;
+}
+
+// Helper function to start refreshing a history walked from old_tips
+void start_history_refresh(HistoryRefresh& refresh, const CommitLoader& loader, const vector<RefTip>& old_tips) {
+    refresh.repo_path = loader.repo_path;
+    refresh.path = loader.path;
+    refresh.refs = loader.refs;
+    refresh.with_head = loader.with_head;
+    refresh.old_tips = old_tips;
+    refresh.reload = false;
+    refresh.tips.clear();
+    refresh.commits = CommitStore();
+    refresh.decorations.clear();
+    refresh.error.clear();
+    refresh.done = false;
+    refresh.worker = thread(history_refresh_run, &refresh);
+}
+
+// Helper function to watch one directory under refs/ and, recursively,
+// every directory below it
+void watch_refs_dir(RefsWatch& watch, const string& dir) {
+    int wd = inotify_add_watch(watch.fd, dir.c_str(),
+                               IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ONLYDIR);
+    if (wd < 0) return;
+    watch.dirs[wd] = dir;
+
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return;
+    while (struct dirent* entry = readdir(handle)) {
+        if (entry->d_name[0] == '.') continue;
+        string child = dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) watch_refs_dir(watch, child);
+    }
+    closedir(handle);
+}
+
+// Helper function to start watching a repository's refs. Leaves the watch
+// closed (fd -1) where inotify is not available.
+void open_refs_watch(RefsWatch& watch, git_repository* repo) {
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd < 0) return;
+    string git_dir = git_repository_commondir(repo);
+    if (!git_dir.empty() && git_dir.back() == '/') git_dir.pop_back();
+    watch.git_dir_watch = inotify_add_watch(watch.fd, git_dir.c_str(),
+                                            IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_ONLYDIR);
+    watch_refs_dir(watch, git_dir + "/refs");
+
+    // A worktree keeps its own HEAD apart from the common directory
+    string worktree_dir = git_repository_path(repo);
+    if (!worktree_dir.empty() && worktree_dir.back() == '/') worktree_dir.pop_back();
+    if (worktree_dir != git_dir)
+        watch.dirs[inotify_add_watch(watch.fd, worktree_dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)] = "";
+}
+
+void close_refs_watch(RefsWatch& watch) {
+    if (watch.fd >= 0) close(watch.fd);
+    watch.fd = -1;
+}
+
+// Helper function to read the pending inotify events, noting whether any
+// ref changed. Lock files come and go around every ref update; only the
+// rename into place counts. Returns whether anything changed.
+bool drain_refs_watch(RefsWatch& watch) {
+    if (watch.fd < 0) return false;
+    alignas(struct inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t length;
+    while ((length = read(watch.fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+            string name = event->len ? event->name : "";
+            if (name.size() >= 5 && name.compare(name.size() - 5, 5, ".lock") == 0) continue;
+
+            auto it = watch.dirs.find(event->wd);
+            if (it == watch.dirs.end() || it->second.empty()) {
+                // The git directory itself: only HEAD and packed-refs are refs
+                if (name == "HEAD" || name == "packed-refs") changed = true;
+            } else if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) watch_refs_dir(watch, it->second + "/" + name);
+                changed = true;
+            } else if (!(event->mask & IN_IGNORED)) {
+                changed = true;
+            }
+            if (event->mask & IN_IGNORED) watch.dirs.erase(event->wd);
+        }
+    }
+    if (changed) {
+        watch.changed = true;
+        watch.last_change = chrono::steady_clock::now();
+    }
+    return changed;
+}
+
+// Helper function to build the patch of one file of a diff, keeping at most
+// limit bytes of it. Only that file's blobs are diffed.
+int collect_file_patch(git_diff* diff, size_t index, DiffText& text, size_t limit,
+                       const DiffCancel* cancel = NULL) {
+    ScopedTimer timer(TIMER_PATCH_PRINT);
+    git_patch* patch = NULL;
+    PatchBuild build = {&text, cancel};
+    text.limit = min(limit, (size_t)UINT32_MAX);
+    int error = git_patch_from_diff(&patch, diff, index);
+    if (error == 0 && patch) error = git_patch_print(patch, diff_line_callback, &build);
+    if (text.truncated) error = 0;
+    git_patch_free(patch);
+    return error;
+}
+
+// Helper function to build the patch of a listed file straight from its two
+// blobs, for files the diff at hand pairs up differently (a rename found by
+// one pass and not by another). Renames and copies get git's header lines.
+int collect_blob_patch(git_repository* repo, const FileDelta& file, DiffText& text, size_t limit,
+                       const DiffCancel* cancel = NULL) {
+    ScopedTimer timer(TIMER_PATCH_PRINT);
+    text.limit = min(limit, (size_t)UINT32_MAX);
+    git_blob* old_blob = NULL;
+    git_blob* new_blob = NULL;
+    git_patch* patch = NULL;
+    PatchBuild build = {&text, cancel};
+    int error = 0;
+    if (!git_oid_is_zero(&file.old_id)) error = git_blob_lookup(&old_blob, repo, &file.old_id);
+    if (error == 0 && !git_oid_is_zero(&file.new_id)) error = git_blob_lookup(&new_blob, repo, &file.new_id);
+    if (error == 0) error = git_patch_from_blobs(&patch, old_blob, file.old_path.c_str(),
+                                                 new_blob, file.new_path.c_str(), NULL);
+    if (error == 0 && patch) error = git_patch_print(patch, diff_line_callback, &build);
+    if (text.truncated) error = 0;
+
+    // Slot the rename lines in after "diff --git", where git prints them
+    if (error == 0 && (file.status == GIT_DELTA_RENAMED || file.status == GIT_DELTA_COPIED)) {
+        const char* verb = file.status == GIT_DELTA_RENAMED ? "rename" : "copy";
+        string headers[] = {"similarity index " + to_string(file.similarity) + "%",
+                            string(verb) + " from " + file.old_path,
+                            string(verb) + " to " + file.new_path};
+        size_t at = min(text.offsets.size(), (size_t)1);
+        size_t position = at < text.offsets.size() ? text.offsets[at] : text.bytes.size();
+        string inserted;
+        vector<uint32_t> offsets;
+        for (const string& header : headers) {
+            offsets.push_back(position + inserted.size());
+            inserted += header;
+        }
+        for (size_t i = at; i < text.offsets.size(); i++) text.offsets[i] += inserted.size();
+        text.bytes.insert(position, inserted);
+        text.offsets.insert(text.offsets.begin() + at, offsets.begin(), offsets.end());
+        text.origins.insert(at, 3, 'F');
+    }
+    git_patch_free(patch);
+    git_blob_free(old_blob);
+    git_blob_free(new_blob);
+    return error;
+}
+
+// Helper function to find a listed file among a diff's deltas, trying the
+// index it was listed at first
+int find_file_delta(git_diff* diff, const FileDelta& file, size_t hint) {
+    size_t num_deltas = git_diff_num_deltas(diff);
+    for (size_t n = 0; n < num_deltas; ++n) {
+        size_t i = (hint + n) % num_deltas;
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        if (delta->status == file.status && git_oid_equal(&delta->old_file.id, &file.old_id) &&
+            git_oid_equal(&delta->new_file.id, &file.new_id) &&
+            file.old_path == delta->old_file.path && file.new_path == delta->new_file.path)
+            return (int)i;
+    }
+    return -1;
+}
+
+// Helper function to diff a commit's tree against its first parent's (or
+// the empty tree for a root commit)
+int diff_commit_trees(git_repository* repo, const git_oid& oid, git_diff** diff,
+                      const DiffCancel* cancel = NULL) {
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    if (cancel) {
+        options.progress_cb = diff_progress_callback;
+        options.payload = const_cast<DiffCancel*>(cancel);
+    }
+
+    git_commit* commit = NULL;
+    git_commit* parent = NULL;
+    git_tree* tree = NULL;
+    git_tree* parent_tree = NULL;
+
+    int error = git_commit_lookup(&commit, repo, &oid);
+    if (error == 0) error = git_commit_tree(&tree, commit);
+    if (error == 0 && git_commit_parentcount(commit) > 0) {
+        error = git_commit_parent(&parent, commit, 0);
+        if (error == 0) error = git_commit_tree(&parent_tree, parent);
+    }
+    if (error == 0) {
+        ScopedTimer timer(TIMER_TREE_DIFF);
+        error = git_diff_tree_to_tree(diff, repo, parent_tree, tree, &options);
+    }
+
+    if (tree) git_tree_free(tree);
+    if (parent_tree) git_tree_free(parent_tree);
+    if (commit) git_commit_free(commit);
+    if (parent) git_commit_free(parent);
+    return error;
+}
+
+// Deadline of one similarity pass. The metric below is libgit2's default
+// (hashsig signatures) with a clock check in front, since git_diff_find_similar
+// itself can't be interrupted.
+struct RenameBudget {
+    chrono::steady_clock::time_point deadline;
+    const DiffCancel* cancel;
+    bool expired;
+};
+
+// Helper function to tell whether a similarity pass has to give up
+bool rename_budget_spent(void* payload) {
+    RenameBudget* budget = static_cast<RenameBudget*>(payload);
+    if (!budget->expired)
+        budget->expired = diff_cancelled(budget->cancel) || chrono::steady_clock::now() >= budget->deadline;
+    return budget->expired;
+}
+
+// Callback functions implementing the budgeted similarity metric. Files too
+// small for a signature get none, which libgit2 scores as dissimilar.
+int rename_file_signature(void** out, const git_diff_file* file, const char* fullpath, void* payload) {
+    if (rename_budget_spent(payload)) return GIT_EUSER;
+    int error = git_hashsig_create_fromfile((git_hashsig**)out, fullpath, GIT_HASHSIG_SMART_WHITESPACE);
+    if (error == GIT_EBUFS) {
+        *out = NULL;
+        git_error_clear();
+        error = 0;
+    }
+    return error;
+}
+
+int rename_buffer_signature(void** out, const git_diff_file* file, const char* buf, size_t buflen,
+                            void* payload) {
+    if (rename_budget_spent(payload)) return GIT_EUSER;
+    int error = git_hashsig_create((git_hashsig**)out, buf, buflen, GIT_HASHSIG_SMART_WHITESPACE);
+    if (error == GIT_EBUFS) {
+        *out = NULL;
+        git_error_clear();
+        error = 0;
+    }
+    return error;
+}
+
+void rename_free_signature(void* signature, void* payload) {
+    git_hashsig_free((git_hashsig*)signature);
+}
+
+int rename_similarity(int* score, void* a, void* b, void* payload) {
+    if (rename_budget_spent(payload)) return GIT_EUSER;
+    int error = git_hashsig_compare((git_hashsig*)a, (git_hashsig*)b);
+    if (error < 0) return error;
+    *score = error;
+    return 0;
+}
+
+// Helper function to pair up a diff's added/deleted files as renames and
+// copies. Past the time budget only exact (same blob) matches are paired,
+// which needs no blob reads at all.
+void find_renames(git_diff* diff, const RenameLimits& limits, const DiffCancel* cancel = NULL) {
+    if (limits.candidates == 0) return;
+    ScopedTimer timer(TIMER_FIND_RENAMES);
+
+    RenameBudget budget = {chrono::steady_clock::now() + chrono::milliseconds(limits.budget_ms), cancel, false};
+    git_diff_similarity_metric metric = {rename_file_signature, rename_buffer_signature,
+                                         rename_free_signature, rename_similarity, &budget};
+    git_diff_find_options options = GIT_DIFF_FIND_OPTIONS_INIT;
+    options.flags = GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES;
+    options.rename_limit = limits.candidates;
+    options.metric = &metric;
+    if (git_diff_find_similar(diff, &options) == 0 || diff_cancelled(cancel)) return;
+
+    // Nothing was rewritten by the aborted pass, so the deltas are still raw
+    git_error_clear();
+    options.flags |= GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+    options.metric = NULL;
+    git_diff_find_similar(diff, &options);
+}
+
+// Helper function to keep a commit's delta list, plus the patches of as
+// many files as fit in patch_budget bytes
+void fill_changed_files(git_diff* diff, ChangedFiles& changes, size_t patch_budget) {
+    size_t num_deltas = git_diff_num_deltas(diff);
+    changes.files.reserve(num_deltas);
+    changes.bytes = sizeof(ChangedFiles);
+    for (size_t i = 0; i < num_deltas; ++i) {
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        FileDelta file;
+        file.status = delta->status;
+        file.old_path = delta->old_file.path;
+        file.new_path = delta->new_file.path;
+        file.old_id = delta->old_file.id;
+        file.new_id = delta->new_file.id;
+        file.similarity = delta->similarity;
+        changes.bytes += sizeof(FileDelta) + file.old_path.capacity() + file.new_path.capacity();
+        changes.files.push_back(file);
+    }
+
+    // A patch that doesn't fit the remaining budget is left for the UI to
+    // build on demand rather than kept truncated
+    size_t patch_bytes = 0;
+    for (size_t i = 0; i < num_deltas && patch_bytes < patch_budget; ++i) {
+        auto text = make_shared<DiffText>();
+        if (collect_file_patch(diff, i, *text, patch_budget - patch_bytes) < 0 || text->truncated) break;
+        text->bytes.shrink_to_fit();
+        patch_bytes += text->bytes.capacity() + text->offsets.size() * sizeof(uint32_t) + text->origins.size();
+        changes.patches.resize(i + 1);
+        changes.patches[i] = text;
+    }
+    changes.bytes += patch_bytes;
+}
+
+// Helper function to diff a commit and collect its changed files in one go
+int load_changed_files(git_repository* repo, const git_oid& oid, ChangedFiles& changes,
+                       size_t patch_budget, const RenameLimits& renames) {
+    git_diff* diff = NULL;
+    int error = diff_commit_trees(repo, oid, &diff);
+    if (error == 0) {
+        find_renames(diff, renames);
+        fill_changed_files(diff, changes, patch_budget);
+    }
+    git_diff_free(diff);
+    return error;
+}
+
+// Helper function to return the selected commit's diff, building it only
+// when the selection moved to another commit
+git_diff* selected_commit_diff(SelectedDiff& selected, git_repository* repo, const git_oid& oid,
+                               const DiffCancel* cancel = NULL) {
+    if (selected.diff && git_oid_equal(&selected.oid, &oid)) return selected.diff;
+
+    git_diff_free(selected.diff);
+    selected.diff = NULL;
+    if (diff_commit_trees(repo, oid, &selected.diff, cancel) == 0) {
+        selected.oid = oid;
+    } else {
+        git_diff_free(selected.diff);
+        selected.diff = NULL;
+    }
+    return selected.diff;
+}
+
+// Helper function to look a commit up in the cache without doing any git work
+shared_ptr<const ChangedFiles> find_changed_files(FileListCache& cache, const git_oid& oid) {
+    lock_guard<mutex> guard(cache.lock);
+    auto it = cache.lookup.find(oid);
+    if (it == cache.lookup.end()) return NULL;
+    cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+    return it->second->second;
+}
+
+// Helper function to add a freshly diffed commit, evicting least recently
+// used lists but always keeping the one just added
+void store_changed_files(FileListCache& cache, const git_oid& oid,
+                         shared_ptr<const ChangedFiles> changes) {
+    lock_guard<mutex> guard(cache.lock);
+    if (cache.lookup.count(oid)) return;   // Another thread got there first
+
+    cache.entries.emplace_front(oid, changes);
+    cache.lookup[oid] = cache.entries.begin();
+    cache.used_bytes += changes->bytes;
+    while (cache.used_bytes > cache.capacity_bytes && cache.entries.size() > 1) {
+        cache.used_bytes -= cache.entries.back().second->bytes;
+        cache.lookup.erase(cache.entries.back().first);
+        cache.entries.pop_back();
+    }
+}
+
+// Helper function to fetch a commit's changed files, diffing only on a cache
+// miss. The diff built for a miss is kept as the selected diff.
+shared_ptr<const ChangedFiles> get_changed_files(FileListCache& cache, SelectedDiff& selected,
+                                                 git_repository* repo, const git_oid& oid,
+                                                 const DiffCancel* cancel = NULL) {
+    shared_ptr<const ChangedFiles> cached = find_changed_files(cache, oid);
+    if (cached) {
+        cache.hits++;
+        return cached;
+    }
+
+    cache.misses++;
+    auto changes = make_shared<ChangedFiles>();
+    git_diff* diff = selected_commit_diff(selected, repo, oid, cancel);
+    if (!diff) return changes;  // Don't cache failures
+    find_renames(diff, cache.renames, cancel);
+    if (diff_cancelled(cancel)) {
+        // Start the next attempt from an unpaired diff rather than pair twice
+        git_diff_free(selected.diff);
+        selected.diff = NULL;
+        return changes;
+    }
+    fill_changed_files(diff, *changes, 0);
+    store_changed_files(cache, oid, changes);
+    return changes;
+}
+
+// Helper function to build the patch of a working-tree file: its staged
+// change (HEAD against the index) or its unstaged one (the index against
+// the file on disk). An untracked directory gets every file in it.
+int collect_worktree_patch(git_repository* repo, const FileDelta& file, bool staged, DiffText& text, size_t limit,
+                           const DiffCancel* cancel) {
+    string path = file.new_path;
+    if (!path.empty() && path.back() == '/') path.pop_back();
+    char* paths[] = {(char*)path.c_str()};
+    git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+    opts.flags = GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS |
+                 GIT_DIFF_SHOW_UNTRACKED_CONTENT | GIT_DIFF_INCLUDE_TYPECHANGE;
+    opts.pathspec.strings = paths;
+    opts.pathspec.count = 1;
+
+    git_diff* diff = NULL;
+    int error;
+    if (staged) {
+        git_object* head = NULL;   // Stays NULL on an unborn branch: everything is added
+        if (git_revparse_single(&head, repo, "HEAD^{tree}") < 0) git_error_clear();
+        error = git_diff_tree_to_index(&diff, repo, (git_tree*)head, NULL, &opts);
+        git_object_free(head);
+    } else {
+        error = git_diff_index_to_workdir(&diff, repo, NULL, &opts);
+    }
+    for (size_t i = 0; error == 0 && i < git_diff_num_deltas(diff) && !text.truncated; i++)
+        error = collect_file_patch(diff, i, text, limit, cancel);
+    git_diff_free(diff);
+    return error;
+}
+
+// Diff job worker: owns the selected commit's diff (and its own repository)
+// so that the UI thread never waits on libgit2
+void diff_job_worker_run(DiffJobs* jobs) {
+    name_trace_thread("diff jobs");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, jobs->repo_path.c_str()) < 0) return;
+    SelectedDiff selected;
+
+    while (true) {
+        DiffJob job;
+        {
+            unique_lock<mutex> guard(jobs->lock);
+            jobs->wake.wait(guard, [&] { return jobs->stop || jobs->has_job; });
+            if (jobs->stop) break;
+            job = jobs->job;
+            jobs->has_job = false;
+        }
+
+        DiffCancel cancel = {&jobs->generation, job.generation};
+        shared_ptr<const ChangedFiles> files;
+        shared_ptr<DiffText> text;
+        if (job.file_index < 0) {
+            files = get_changed_files(*jobs->cache, selected, repo, job.oid, &cancel);
+        } else if (job.worktree) {
+            text = make_shared<DiffText>();
+            collect_worktree_patch(repo, job.file, job.worktree == WORKTREE_STAGED, *text, job.limit, &cancel);
+        } else {
+            text = make_shared<DiffText>();
+            // The list may have come from a prefetch whose rename pass got
+            // further (or less far) than the one behind this diff
+            git_diff* diff = selected_commit_diff(selected, repo, job.oid, &cancel);
+            int index = diff ? find_file_delta(diff, job.file, job.file_index) : -1;
+            if (index >= 0) collect_file_patch(diff, index, *text, job.limit, &cancel);
+            else if (!diff_cancelled(&cancel)) collect_blob_patch(repo, job.file, *text, job.limit, &cancel);
+        }
+        if (diff_cancelled(&cancel)) continue;
+
+        lock_guard<mutex> guard(jobs->lock);
+        jobs->has_result = true;
+        jobs->result_job = job;
+        jobs->files = files;
+        jobs->text = text;
+    }
+    git_diff_free(selected.diff);
+    git_repository_free(repo);
+}
+
+void start_diff_jobs(DiffJobs& jobs, const char* repo_path, FileListCache& cache) {
+    jobs.repo_path = repo_path;
+    jobs.cache = &cache;
+    jobs.worker = thread(diff_job_worker_run, &jobs);
+}
+
+// Helper function to drop the current job and any result it left behind
+void cancel_diff_job(DiffJobs& jobs) {
+    lock_guard<mutex> guard(jobs.lock);
+    jobs.generation++;
+    jobs.has_job = false;
+    jobs.has_result = false;
+}
+
+void stop_diff_jobs(DiffJobs& jobs) {
+    {
+        lock_guard<mutex> guard(jobs.lock);
+        jobs.stop = true;
+    }
+    jobs.generation++;   // Abort whatever is running
+    jobs.wake.notify_all();
+    jobs.worker.join();
+}
+
+// Helper function to hand a job to the worker. Bumping the generation
+// cancels the job in flight and voids any result not yet picked up.
+void post_diff_job(DiffJobs& jobs, const git_oid& oid, int file_index, size_t limit,
+                   const FileDelta* file = NULL, int worktree = 0) {
+    {
+        lock_guard<mutex> guard(jobs.lock);
+        jobs.job.generation = ++jobs.generation;
+        jobs.job.oid = oid;
+        jobs.job.file_index = file_index;
+        if (file) jobs.job.file = *file;
+        jobs.job.limit = limit;
+        jobs.job.worktree = worktree;
+        jobs.has_job = true;
+        jobs.has_result = false;
+    }
+    jobs.wake.notify_all();
+}
+
+// Helper function to take the current job's result, if it has finished
+bool take_diff_result(DiffJobs& jobs, DiffJob& job, shared_ptr<const ChangedFiles>& files,
+                      shared_ptr<const DiffText>& text) {
+    lock_guard<mutex> guard(jobs.lock);
+    if (!jobs.has_result || jobs.result_job.generation != jobs.generation) return false;
+    jobs.has_result = false;
+    job = jobs.result_job;
+    files = jobs.files;
+    text = jobs.text;
+    jobs.files = NULL;
+    jobs.text = NULL;
+    return true;
+}
+
+// Prefetch worker: diffs queued commits with its own repository handle,
+// since libgit2 objects must not be shared between threads
+void prefetch_worker_run(Prefetcher* prefetcher) {
+    name_trace_thread("prefetch");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, prefetcher->repo_path.c_str()) < 0) return;
+
+    while (true) {
+        git_oid oid;
+        {
+            unique_lock<mutex> guard(prefetcher->lock);
+            prefetcher->wake.wait(guard, [&] { return prefetcher->stop || !prefetcher->queue.empty(); });
+            if (prefetcher->stop) break;
+            oid = prefetcher->queue.front();
+            prefetcher->queue.pop_front();
+        }
+        if (find_changed_files(*prefetcher->cache, oid)) continue;
+
+        auto changes = make_shared<ChangedFiles>();
+        if (load_changed_files(repo, oid, *changes, PREFETCH_PATCH_BYTES, prefetcher->cache->renames) == 0) {
+            store_changed_files(*prefetcher->cache, oid, changes);
+            prefetcher->prefetched++;
+        }
+    }
+    git_repository_free(repo);
+}
+
+// Helper function to start the prefetch workers
+void start_prefetcher(Prefetcher& prefetcher, const char* repo_path, FileListCache& cache) {
+    prefetcher.repo_path = repo_path;
+    prefetcher.cache = &cache;
+    for (int i = 0; i < PREFETCH_WORKERS; i++)
+        prefetcher.workers.emplace_back(prefetch_worker_run, &prefetcher);
+}
+
+void stop_prefetcher(Prefetcher& prefetcher) {
+    {
+        lock_guard<mutex> guard(prefetcher.lock);
+        prefetcher.stop = true;
+    }
+    prefetcher.wake.notify_all();
+    for (thread& worker : prefetcher.workers) worker.join();
+}
+
+// Helper function to queue the commits around the cursor, nearest first.
+// The window leans in the scroll direction: depth commits ahead, a quarter
+// of that behind. Anything still queued from the previous position is dropped.
+void prefetch_around(Prefetcher& prefetcher, const CommitStore& store, const vector<int>* rows,
+                     int count, int center, int direction, int depth) {
+    deque<git_oid> queue;
+    int behind = max(depth / 4, 1);
+    for (int step = 1; step <= depth; step++) {
+        int ahead_index = center + step * direction;
+        if (ahead_index >= 0 && ahead_index < count) queue.push_back(store.oids[row_commit(rows, ahead_index)]);
+        int behind_index = center - step * direction;
+        if (step <= behind && behind_index >= 0 && behind_index < count)
+            queue.push_back(store.oids[row_commit(rows, behind_index)]);
+    }
+    {
+        lock_guard<mutex> guard(prefetcher.lock);
+        prefetcher.queue.swap(queue);
+    }
+    prefetcher.wake.notify_all();
+}
+
+// Helper function to count a file change's added and deleted lines
+LineStats count_line_stats(git_repository* repo, const BlobPair& pair) {
+    ScopedTimer timer(TIMER_LINE_STATS);
+    LineStats stats;
+    git_blob* old_blob = NULL;
+    git_blob* new_blob = NULL;
+    git_patch* patch = NULL;
+    int error = 0;
+    if (!git_oid_is_zero(&pair.old_id)) error = git_blob_lookup(&old_blob, repo, &pair.old_id);
+    if (error == 0 && !git_oid_is_zero(&pair.new_id)) error = git_blob_lookup(&new_blob, repo, &pair.new_id);
+    if (error == 0) error = git_patch_from_blobs(&patch, old_blob, NULL, new_blob, NULL, NULL);
+    if (error == 0 && patch) {
+        size_t context, added, deleted;
+        git_patch_line_stats(&context, &added, &deleted, patch);
+        stats.added = added;
+        stats.deleted = deleted;
+        stats.binary = (git_patch_get_delta(patch)->flags & GIT_DIFF_FLAG_BINARY) != 0;
+    }
+    git_patch_free(patch);
+    git_blob_free(old_blob);
+    git_blob_free(new_blob);
+    return stats;
+}
+
+// Diffstat worker: counts queued blob pairs not yet in the memo
+void diff_stats_worker_run(DiffStats* stats) {
+    name_trace_thread("line stats");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, stats->repo_path.c_str()) < 0) return;
+
+    while (true) {
+        BlobPair pair;
+        {
+            unique_lock<mutex> guard(stats->lock);
+            stats->wake.wait(guard, [&] { return stats->stop || !stats->queue.empty(); });
+            if (stats->stop) break;
+            pair = stats->queue.front();
+            auto it = stats->counted.find(pair);
+            if (it != stats->counted.end()) {
+                stats->queued_total.added += it->second.added;
+                stats->queued_total.deleted += it->second.deleted;
+                stats->queue.pop_front();
+                if (stats->queue.empty()) stats->computed++;   // Total is ready
+                continue;
+            }
+        }
+
+        // Counted unlocked; the pair stays queued so the total can't be
+        // reported before it is added in
+        LineStats counts = count_line_stats(repo, pair);
+        {
+            lock_guard<mutex> guard(stats->lock);
+            stats->counted[pair] = counts;
+        }
+        stats->computed++;
+    }
+    git_repository_free(repo);
+}
+
+void start_diff_stats(DiffStats& stats, const char* repo_path) {
+    stats.repo_path = repo_path;
+    stats.worker = thread(diff_stats_worker_run, &stats);
+}
+
+void stop_diff_stats(DiffStats& stats) {
+    {
+        lock_guard<mutex> guard(stats.lock);
+        stats.stop = true;
+    }
+    stats.wake.notify_all();
+    stats.worker.join();
+}
+
+// Helper function to queue a commit's files for counting: the rows from
+// first_visible on, wrapping round to the ones above them
+void request_line_stats(DiffStats& stats, shared_ptr<const ChangedFiles> list, int first_visible) {
+    const vector<FileDelta>& files = list->files;
+    deque<BlobPair> queue;
+    for (size_t n = 0; n < files.size(); n++) {
+        const FileDelta& file = files[(first_visible + n) % files.size()];
+        queue.push_back({file.old_id, file.new_id});
+    }
+    {
+        lock_guard<mutex> guard(stats.lock);
+        stats.queue.swap(queue);
+        stats.queued_list = list;
+        stats.queued_total = LineStats();
+    }
+    stats.wake.notify_all();
+}
+
+// Helper function to read a list's total once all of its files are counted
+bool line_stats_total(DiffStats& stats, const shared_ptr<const ChangedFiles>& list, LineStats& total) {
+    lock_guard<mutex> guard(stats.lock);
+    if (stats.queued_list != list || !stats.queue.empty()) return false;
+    total = stats.queued_total;
+    return true;
+}
+
+// Helper function to read the counts of files[begin, end), NULL for any
+// not counted yet
+void lookup_line_stats(DiffStats& stats, const vector<FileDelta>& files, int begin, int end,
+                       vector<const LineStats*>& out) {
+    out.assign(end - begin, NULL);
+    lock_guard<mutex> guard(stats.lock);
+    for (int i = begin; i < end; i++) {
+        auto it = stats.counted.find({files[i].old_id, files[i].new_id});
+        if (it != stats.counted.end()) out[i - begin] = &it->second;   // Entries never move or go away
+    }
+}
+
+// Helper function to format a file's counts for its row
+string format_line_stats(const LineStats& stats) {
+    if (stats.binary) return "bin";
+    return "+" + to_string(stats.added) + " -" + to_string(stats.deleted);
+}
+
+// Helper function to read a file as of a commit and split it into lines
+bool load_blame_content(git_repository* repo, const BlameFile& file, string& bytes,
+                        vector<uint32_t>& offsets, string& error) {
+    git_commit* commit = NULL;
+    git_tree* tree = NULL;
+    git_tree_entry* entry = NULL;
+    git_blob* blob = NULL;
+    bool ok = git_commit_lookup(&commit, repo, &file.commit) == 0 &&
+              git_commit_tree(&tree, commit) == 0 &&
+              git_tree_entry_bypath(&entry, tree, file.path.c_str()) == 0 &&
+              git_blob_lookup(&blob, repo, git_tree_entry_id(entry)) == 0;
+    if (!ok) {
+        const git_error* e = git_error_last();
+        error = e ? e->message : "cannot read the file at this commit";
+    } else if (git_blob_is_binary(blob)) {
+        ok = false;
+        error = "binary file";
+    } else {
+        const char* data = (const char*)git_blob_rawcontent(blob);
+        size_t size = git_blob_rawsize(blob);
+        for (size_t start = 0; start < size;) {
+            const char* newline = (const char*)memchr(data + start, '\n', size - start);
+            size_t end = newline ? newline - data : size;
+            offsets.push_back(bytes.size());
+            bytes.append(data + start, end - start);
+            start = end + 1;
+        }
+        offsets.push_back(bytes.size());
+    }
+    if (blob) git_blob_free(blob);
+    if (entry) git_tree_entry_free(entry);
+    if (tree) git_tree_free(tree);
+    if (commit) git_commit_free(commit);
+    return ok;
+}
+
+// Blame worker: reads the file on its first request, then blames the
+// requested lines only. Hunks are copied out so the git_blame can go.
+void blame_worker_run(BlameJobs* jobs) {
+    name_trace_thread("blame");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, jobs->repo_path.c_str()) < 0) return;
+
+    while (true) {
+        shared_ptr<BlameFile> file;
+        int first, last;
+        bool loaded;
+        {
+            unique_lock<mutex> guard(jobs->lock);
+            jobs->wake.wait(guard, [&] { return jobs->stop || jobs->job_file; });
+            if (jobs->stop) break;
+            file = jobs->job_file;
+            jobs->job_file = NULL;
+            first = jobs->job_first;
+            last = jobs->job_last;
+            loaded = file->loaded;
+        }
+
+        if (!loaded) {
+            string bytes, error;
+            vector<uint32_t> offsets;
+            bool ok = load_blame_content(repo, *file, bytes, offsets, error);
+            lock_guard<mutex> guard(jobs->lock);
+            file->loaded = true;
+            file->error = error;
+            file->bytes.swap(bytes);
+            file->offsets.swap(offsets);
+            if (ok) file->line_hunks.assign(file->offsets.size() - 1, BLAME_PENDING);
+            last = min(last, (int)file->line_hunks.size() - 1);
+        }
+
+        vector<BlameHunk> hunks;
+        vector<pair<int, int>> runs;   // First line and length of each hunk
+        string error;
+        if (first <= last) {
+            ScopedTimer timer(TIMER_BLAME);
+            git_blame_options options;
+            git_blame_options_init(&options, GIT_BLAME_OPTIONS_VERSION);
+            options.newest_commit = file->commit;
+            options.min_line = first + 1;
+            options.max_line = last + 1;
+            git_blame* blame = NULL;
+            if (git_blame_file(&blame, repo, file->path.c_str(), &options) == 0) {
+                for (uint32_t i = 0; i < git_blame_get_hunk_count(blame); i++) {
+                    const git_blame_hunk* hunk = git_blame_get_hunk_byindex(blame, i);
+                    const git_signature* author = hunk->final_signature;
+                    hunks.push_back({hunk->final_commit_id, author ? author->name : "",
+                                     author ? (int64_t)author->when.time : 0});
+                    runs.push_back({(int)hunk->final_start_line_number - 1, (int)hunk->lines_in_hunk});
+                }
+                git_blame_free(blame);
+            } else {
+                const git_error* e = git_error_last();
+                error = e ? e->message : "blame failed";
+            }
+        }
+
+        lock_guard<mutex> guard(jobs->lock);
+        if (first <= last) {
+            if (!error.empty()) file->error = error;
+            for (size_t i = 0; i < hunks.size(); i++) {
+                int index = file->hunks.size();
+                file->hunks.push_back(hunks[i]);
+                int begin = max(runs[i].first, first);
+                int end = min(runs[i].first + runs[i].second - 1, last);
+                for (int line = begin; line <= end; line++) file->line_hunks[line] = index;
+            }
+            // Lines the blame left out are not asked for again
+            for (int line = first; line <= last; line++) {
+                if (file->line_hunks[line] == BLAME_PENDING) file->line_hunks[line] = BLAME_UNKNOWN;
+            }
+        }
+        jobs->busy = false;
+        jobs->finished++;
+    }
+    git_repository_free(repo);
+}
+
+void start_blame_jobs(BlameJobs& jobs, const char* repo_path) {
+    jobs.repo_path = repo_path;
+    jobs.worker = thread(blame_worker_run, &jobs);
+}
+
+void stop_blame_jobs(BlameJobs& jobs) {
+    {
+        lock_guard<mutex> guard(jobs.lock);
+        jobs.stop = true;
+    }
+    jobs.wake.notify_all();
+    jobs.worker.join();
+}
+
+// Helper function to find the blame of a file at a commit among the ones
+// opened recently, or start a new one
+shared_ptr<BlameFile> open_blame(BlameJobs& jobs, const git_oid& commit, const string& path) {
+    for (auto it = jobs.cache.begin(); it != jobs.cache.end(); ++it) {
+        if (git_oid_equal(&(*it)->commit, &commit) && (*it)->path == path) {
+            jobs.cache.splice(jobs.cache.begin(), jobs.cache, it);
+            return jobs.cache.front();
+        }
+    }
+    shared_ptr<BlameFile> file = make_shared<BlameFile>();
+    file->commit = commit;
+    file->path = path;
+    jobs.cache.push_front(file);
+    if (jobs.cache.size() > BLAME_CACHE_FILES) jobs.cache.pop_back();
+    return file;
+}
+
+// Helper function to have the lines [first, last] of a file blamed, from
+// the first to the last of them still pending. Each blame walks the
+// file's history however few lines it covers, so a range is never shorter
+// than two margins. Returns whether the worker has (or still has) work.
+bool request_blame(BlameJobs& jobs, const shared_ptr<BlameFile>& file, int first, int last) {
+    {
+        lock_guard<mutex> guard(jobs.lock);
+        if (jobs.busy) return true;
+        if (file->loaded) {
+            int lines = file->line_hunks.size();
+            last = min(last, lines - 1);
+            while (first <= last && file->line_hunks[first] != BLAME_PENDING) first++;
+            while (last >= first && file->line_hunks[last] != BLAME_PENDING) last--;
+            if (first > last) return false;
+            last = min(max(last, first + 2 * BLAME_MARGIN_LINES - 1), lines - 1);
+        }
+        jobs.job_file = file;
+        jobs.job_first = first;
+        jobs.job_last = last;
+        jobs.busy = true;
+    }
+    jobs.wake.notify_all();
+    return true;
+}
+
+// Helper function to count the lines of a blame, 0 until the file is read
+int blame_line_count(BlameJobs& jobs, const BlameFile& file) {
+    lock_guard<mutex> guard(jobs.lock);
+    return file.line_hunks.size();
+}
+
+// Helper function to find the row of a commit in the history pane, or -1
+int find_commit_row(const CommitStore& store, const vector<int>* rows, const git_oid& oid) {
+    int count = rows ? rows->size() : store.oids.size();
+    for (int row = 0; row < count; row++) {
+        if (git_oid_equal(&store.oids[row_commit(rows, row)], &oid)) return row;
+    }
+    return -1;
+}
+
+// Helper function to run one status pass over the staged (index_only) or
+// unstaged side, appending to out. paths limits it to those exact paths
+// and everything below them; empty means the whole tree. Stat data that
+// libgit2 refreshes on the way is written back to the index, so the next
+// pass finds those files clean without reading them. While another git
+// holds the index lock, the pass runs read-only instead.
+int scan_status(git_repository* repo, bool index_only, const vector<string>& paths, vector<FileDelta>& out) {
+    ScopedTimer timer(TIMER_STATUS);
+    git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+    opts.show = index_only ? GIT_STATUS_SHOW_INDEX_ONLY : GIT_STATUS_SHOW_WORKDIR_ONLY;
+    opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_EXCLUDE_SUBMODULES |
+                 GIT_STATUS_OPT_SORT_CASE_SENSITIVELY | GIT_STATUS_OPT_UPDATE_INDEX;
+    vector<char*> pathspec;
+    for (const string& path : paths) pathspec.push_back((char*)path.c_str());
+    if (!paths.empty()) {
+        opts.flags |= GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+        opts.pathspec.strings = pathspec.data();
+        opts.pathspec.count = pathspec.size();
+    }
+
+    git_status_list* list = NULL;
+    int error = git_status_list_new(&list, repo, &opts);
+    if (error < 0) {
+        git_error_clear();
+        opts.flags &= ~GIT_STATUS_OPT_UPDATE_INDEX;
+        error = git_status_list_new(&list, repo, &opts);
+    }
+    if (error < 0) return error;
+    for (size_t i = 0; i < git_status_list_entrycount(list); i++) {
+        const git_status_entry* entry = git_status_byindex(list, i);
+        const git_diff_delta* delta = index_only ? entry->head_to_index : entry->index_to_workdir;
+        if (!delta) continue;
+        FileDelta file;
+        file.status = delta->status;
+        file.old_path = delta->old_file.path;
+        file.new_path = delta->new_file.path;
+        file.old_id = delta->old_file.id;
+        file.new_id = delta->new_file.id;
+        out.push_back(file);
+    }
+    git_status_list_free(list);
+    return 0;
+}
+
+// Helper function to hand the worker's lists over to the UI thread
+void publish_worktree(WorktreeStatus& status) {
+    sort(status.unstaged_files.begin(), status.unstaged_files.end(),
+         [](const FileDelta& a, const FileDelta& b) { return a.new_path < b.new_path; });
+    auto files = make_shared<ChangedFiles>();
+    files->files = status.staged_files;
+    files->files.insert(files->files.end(), status.unstaged_files.begin(), status.unstaged_files.end());
+    lock_guard<mutex> guard(status.lock);
+    status.files = files;
+    status.staged = status.staged_files.size();
+    status.version++;
+}
+
+// Helper function to watch a directory of the working tree (relative to
+// it, "" for the top) and every directory below it that git does not
+// ignore. Returns false once inotify runs out of watches.
+bool watch_worktree_dir(WorktreeStatus& status, const string& dir) {
+    string full = dir.empty() ? status.workdir : status.workdir + "/" + dir;
+    int wd = inotify_add_watch(status.fd, full.c_str(),
+                               IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) return errno != ENOSPC && errno != ENOMEM;
+    status.dirs[wd] = dir;
+
+    DIR* handle = opendir(full.c_str());
+    if (!handle) return true;
+    bool complete = true;
+    while (struct dirent* entry = readdir(handle)) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || !strcmp(entry->d_name, ".git")) continue;
+        string child = dir.empty() ? entry->d_name : dir + "/" + entry->d_name;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = lstat((status.workdir + "/" + child).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        int ignored = 0;
+        if (!is_dir || (git_ignore_path_is_ignored(&ignored, status.repo, (child + "/").c_str()) == 0 && ignored))
+            continue;
+        if (!watch_worktree_dir(status, child)) {
+            complete = false;
+            break;
+        }
+    }
+    closedir(handle);
+    return complete;
+}
+
+// Helper function to split the directory at prefix (empty for the top
+// level) into scan units: the names in it on disk and in the index, with
+// the tracked files under each. Entries [begin, end) of the sorted index
+// are the ones below prefix. A directory holding more than
+// WORKTREE_SCAN_CHUNK tracked files is split again by its own entries.
+void worktree_scan_units(const string& workdir, git_index* index, size_t begin, size_t end, const string& prefix,
+                         vector<pair<string, size_t>>& units) {
+    map<string, pair<size_t, size_t>> names;   // Name -> its range of index entries below it
+    DIR* handle = opendir((workdir + "/" + prefix).c_str());
+    while (struct dirent* entry = handle ? readdir(handle) : NULL) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..") && strcmp(entry->d_name, ".git"))
+            names.emplace(entry->d_name, make_pair(begin, begin));
+    }
+    if (handle) closedir(handle);
+    for (size_t i = begin; i < end;) {
+        const char* name = git_index_get_byindex(index, i)->path + prefix.size();
+        const char* slash = strchr(name, '/');
+        size_t length = slash ? slash - name + 1 : strlen(name);
+        size_t last = i + 1;
+        // Everything below a directory is one contiguous run of the index
+        while (slash && last < end && strncmp(git_index_get_byindex(index, last)->path + prefix.size(), name, length) == 0)
+            last++;
+        names[string(name, slash ? length - 1 : length)] = make_pair(i, last);
+        i = last;
+    }
+
+    for (const auto& entry : names) {
+        size_t first = entry.second.first, last = entry.second.second;
+        if (last - first > WORKTREE_SCAN_CHUNK &&
+            strchr(git_index_get_byindex(index, first)->path + prefix.size(), '/')) {
+            worktree_scan_units(workdir, index, first, last, prefix + entry.first + "/", units);
+        } else {
+            units.emplace_back(prefix + entry.first, last - first);
+        }
+    }
+}
+
+// Helper function to list the working tree from scratch. The staged side
+// is one pass; the unstaged side is split into passes of about
+// WORKTREE_SCAN_CHUNK tracked files each, every one published as soon as
+// it is done. A pass covers a run of top-level entries, or of entries of
+// a subdirectory when a single directory holds more than that.
+void full_worktree_scan(WorktreeStatus& status) {
+    status.staged_files.clear();
+    status.unstaged_files.clear();
+    if (scan_status(status.repo, true, {}, status.staged_files) < 0) {
+        const git_error* e = git_error_last();
+        lock_guard<mutex> guard(status.lock);
+        status.error = e ? e->message : "unable to read the index";
+    }
+    publish_worktree(status);
+
+    // Names on disk and in the index (so deleted directories are scanned
+    // too), with the tracked files under each
+    vector<pair<string, size_t>> units;
+    git_index* index = NULL;
+    if (git_repository_index(&index, status.repo) == 0) {
+        worktree_scan_units(status.workdir, index, 0, git_index_entrycount(index), "", units);
+        git_index_free(index);
+    } else {
+        git_error_clear();
+        worktree_scan_units(status.workdir, NULL, 0, 0, "", units);
+    }
+
+    vector<string> chunk;
+    size_t chunk_files = 0;
+    for (size_t i = 0; i < units.size() && !status.stop; i++) {
+        chunk.push_back(units[i].first);
+        chunk_files += max(units[i].second, (size_t)1);
+        if (chunk_files >= WORKTREE_SCAN_CHUNK || i + 1 == units.size()) {
+            scan_status(status.repo, false, chunk, status.unstaged_files);
+            publish_worktree(status);
+            chunk.clear();
+            chunk_files = 0;
+        }
+    }
+}
+
+// Helper function to tell whether a listed path is one of the sorted
+// rescanned paths or lies below one of them
+bool under_paths(string path, const vector<string>& paths) {
+    if (!path.empty() && path.back() == '/') path.pop_back();   // An untracked directory
+    for (size_t end = path.size(); end != string::npos; end = end ? path.rfind('/', end - 1) : string::npos) {
+        if (binary_search(paths.begin(), paths.end(), path.substr(0, end))) return true;
+        if (end == 0) break;
+    }
+    return false;
+}
+
+// Helper function to rescan the paths inotify reported. When the index (or
+// HEAD) changed, the staged side is listed again, and every file staged or
+// modified before or after is rescanned as well: those are the files
+// whose index entries may have moved.
+void rescan_worktree(WorktreeStatus& status, const set<string>& dirty, bool index_changed) {
+    vector<string> paths;
+    if (index_changed) {
+        vector<FileDelta> staged;
+        scan_status(status.repo, true, {}, staged);
+        for (const vector<FileDelta>* list : {&status.staged_files, &staged}) {
+            for (const FileDelta& file : *list) {
+                paths.push_back(file.old_path);
+                paths.push_back(file.new_path);
+            }
+        }
+        for (const FileDelta& file : status.unstaged_files) {
+            if (file.status != GIT_DELTA_UNTRACKED) paths.push_back(file.new_path);
+        }
+        status.staged_files.swap(staged);
+    }
+
+    // A change inside an untracked directory rescans the directory, which
+    // is listed as a whole
+    unordered_set<string> untracked_dirs;
+    for (const FileDelta& file : status.unstaged_files) {
+        if (file.status == GIT_DELTA_UNTRACKED && !file.new_path.empty() && file.new_path.back() == '/')
+            untracked_dirs.insert(file.new_path.substr(0, file.new_path.size() - 1));
+    }
+    for (const string& path : dirty) {
+        string scanned = path;
+        for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1)) {
+            if (untracked_dirs.count(path.substr(0, slash))) {
+                scanned = path.substr(0, slash);
+                break;
+            }
+        }
+        paths.push_back(scanned);
+    }
+    sort(paths.begin(), paths.end());
+    paths.erase(unique(paths.begin(), paths.end()), paths.end());
+
+    if (!paths.empty()) {
+        vector<FileDelta>& files = status.unstaged_files;
+        files.erase(remove_if(files.begin(), files.end(),
+                              [&](const FileDelta& file) { return under_paths(file.new_path, paths); }),
+                    files.end());
+        scan_status(status.repo, false, paths, files);
+    }
+    publish_worktree(status);
+}
+
+// Helper function to read the pending inotify events into dirty paths,
+// relative to the working tree. Returns false if events were lost.
+bool read_worktree_events(WorktreeStatus& status, set<string>& dirty, bool& index_changed) {
+    alignas(struct inotify_event) char buffer[16384];
+    ssize_t length;
+    bool complete = true;
+    while ((length = read(status.fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) complete = false;
+            string name = event->len ? event->name : "";
+            if (event->wd == status.git_dir_watch) {
+                if (name == "index" || name == "HEAD") index_changed = true;
+                continue;
+            }
+            auto it = status.dirs.find(event->wd);
+            if (it == status.dirs.end()) continue;
+            if (event->mask & IN_IGNORED) {
+                status.dirs.erase(it);
+                continue;
+            }
+            if (name.empty() || (it->second.empty() && name == ".git")) continue;
+            string path = it->second.empty() ? name : it->second + "/" + name;
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                int ignored = 0;
+                if ((git_ignore_path_is_ignored(&ignored, status.repo, (path + "/").c_str()) < 0 || !ignored) &&
+                    !watch_worktree_dir(status, path))
+                    complete = false;
+            }
+            dirty.insert(path);
+        }
+    }
+    return complete;
+}
+
+// Status worker: the first full scan, then rescans as the working tree
+// changes. Without inotify (or past its watch limit) it only rescans in
+// full, when the UI asks.
+void worktree_status_run(WorktreeStatus* status) {
+    name_trace_thread("worktree status");
+    bool opened = git_repository_open(&status->repo, status->repo_path.c_str()) == 0;
+    if (!opened || !git_repository_workdir(status->repo)) {
+        const git_error* e = git_error_last();
+        lock_guard<mutex> guard(status->lock);
+        status->error = !opened && e ? e->message : "bare repository, no working tree";
+        status->scanning = false;
+        status->version++;
+        git_repository_free(status->repo);
+        return;
+    }
+    status->workdir = git_repository_workdir(status->repo);
+    if (!status->workdir.empty() && status->workdir.back() == '/') status->workdir.pop_back();
+
+    // Watch before scanning, so nothing changed during the scan is missed
+    string git_dir = git_repository_path(status->repo);
+    status->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    bool watching = status->fd >= 0 && watch_worktree_dir(*status, "");
+    if (watching) {
+        status->git_dir_watch = inotify_add_watch(status->fd, git_dir.c_str(),
+                                                  IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_ONLYDIR);
+    } else if (status->fd >= 0) {
+        close(status->fd);   // A partial watch would miss changes
+        status->fd = -1;
+    }
+    {
+        lock_guard<mutex> guard(status->lock);
+        status->watching = watching;
+    }
+
+    full_worktree_scan(*status);
+    {
+        lock_guard<mutex> guard(status->lock);
+        status->scanning = false;
+        status->version++;
+    }
+
+    set<string> dirty;
+    bool index_changed = false;
+    bool full = false;
+    auto last_event = chrono::steady_clock::now();
+    while (!status->stop) {
+        if (status->fd >= 0) {
+            struct pollfd ready = {status->fd, POLLIN, 0};
+            if (poll(&ready, 1, WORKTREE_POLL_MS) > 0) {
+                if (!read_worktree_events(*status, dirty, index_changed)) full = true;
+                last_event = chrono::steady_clock::now();
+            }
+        } else {
+            this_thread::sleep_for(chrono::milliseconds(WORKTREE_POLL_MS));
+        }
+        {
+            lock_guard<mutex> guard(status->lock);
+            if (status->index_dirty) {
+                index_changed = true;
+                status->index_dirty = false;
+            }
+            if (status->full_rescan) {
+                full = true;
+                status->full_rescan = false;
+            }
+        }
+        bool pending = full || index_changed || !dirty.empty();
+        if (!pending || chrono::steady_clock::now() - last_event < chrono::milliseconds(WORKTREE_SETTLE_MS))
+            continue;
+
+        if (full || (!watching && index_changed) || dirty.size() > WORKTREE_RESCAN_PATHS) {
+            full_worktree_scan(*status);
+        } else {
+            rescan_worktree(*status, dirty, index_changed);
+        }
+        dirty.clear();
+        index_changed = false;
+        full = false;
+    }
+    if (status->fd >= 0) close(status->fd);
+    git_repository_free(status->repo);
+}
+
+void start_worktree_status(WorktreeStatus& status, const char* repo_path) {
+    status.repo_path = repo_path;
+    status.worker = thread(worktree_status_run, &status);
+}
+
+void stop_worktree_status(WorktreeStatus& status) {
+    status.stop = true;
+    if (status.worker.joinable()) status.worker.join();
+}
+
+// Helper function to label a changed file with its delta status; renames
+// and copies carry their similarity, as in git's --name-status
+string delta_status_label(const FileDelta& file) {
+    char label[16];
+    switch (file.status) {
+        case GIT_DELTA_ADDED: return "[A] ";
+        case GIT_DELTA_MODIFIED: return "[M] ";
+        case GIT_DELTA_DELETED: return "[D] ";
+        case GIT_DELTA_TYPECHANGE: return "[T] ";
+        case GIT_DELTA_RENAMED:
+            snprintf(label, sizeof(label), "[R%03u] ", (unsigned)file.similarity);
+            return label;
+        case GIT_DELTA_COPIED:
+            snprintf(label, sizeof(label), "[C%03u] ", (unsigned)file.similarity);
+            return label;
+        default: return "[?] ";
+    }
+}
+
+// Helper function to name a changed file, old path first if it moved
+string delta_display_path(const FileDelta& file) {
+    if (file.status == GIT_DELTA_RENAMED || file.status == GIT_DELTA_COPIED)
+        return file.old_path + " -> " + file.new_path;
+    return file.new_path;
+}
+
+// Helper function to format timestamp
+string format_time(time_t timestamp) {
+    struct tm* timeinfo = localtime(&timestamp);
+    stringstream ss;
+    ss << put_time(timeinfo, "%Y-%m-%d %H:%M:%S");
+    return ss.str();
+}
+
+// Helper function to find every commit whose subject, author name or email
+// contains the query. Lowercase queries ignore case (smart case). The list
+// is split across threads; each scans its slice with strstr.
+void search_commits(CommitSearch& search, const CommitStore& store, const vector<int>* rows, int count) {
+    search.matches.clear();
+    if (search.query.empty() || count == 0) return;
+
+    bool fold = true;
+    for (char c : search.query) {
+        if (isupper((unsigned char)c)) fold = false;
+    }
+    string needle = search.query;
+    const char* arena = store.arena.data();
+    if (fold) {
+        // The arena is only ever appended to, so just fold the new tail
+        size_t folded = search.folded_arena.size();
+        search.folded_arena.resize(store.arena.size());
+        for (size_t i = folded; i < store.arena.size(); i++)
+            search.folded_arena[i] = tolower((unsigned char)store.arena[i]);
+        for (char& c : needle) c = tolower((unsigned char)c);
+        arena = search.folded_arena.data();
+    }
+
+    // Authors are few, so match them once and test commits by author id
+    vector<char> author_hit(store.author_names.size());
+    for (size_t i = 0; i < author_hit.size(); i++) {
+        string name = store.author_names[i];
+        string email = store.author_emails[i];
+        if (fold) {
+            for (char& c : name) c = tolower((unsigned char)c);
+            for (char& c : email) c = tolower((unsigned char)c);
+        }
+        author_hit[i] = name.find(needle) != string::npos || email.find(needle) != string::npos;
+    }
+
+    int workers = max(min((int)thread::hardware_concurrency(), count / SEARCH_MIN_CHUNK), 1);
+    vector<vector<int>> found(workers);
+    vector<thread> threads;
+    for (int t = 0; t < workers; t++) {
+        threads.emplace_back([&, t] {
+            int end = (int64_t)count * (t + 1) / workers;
+            for (int i = (int64_t)count * t / workers; i < end; i++) {
+                int c = row_commit(rows, i);
+                if (author_hit[store.authors[c]] || strstr(arena + store.subjects[c], needle.c_str()))
+                    found[t].push_back(i);
+            }
+        });
+    }
+    for (thread& worker : threads) worker.join();
+    for (const vector<int>& part : found)
+        search.matches.insert(search.matches.end(), part.begin(), part.end());
+}
+
+// Helper function to pick the match after (direction 1) or before (-1) a
+// commit, wrapping around the list. Returns -1 without matches.
+int next_match(const CommitSearch& search, int from, int direction) {
+    const vector<int>& matches = search.matches;
+    if (matches.empty()) return -1;
+    if (direction > 0) {
+        auto it = upper_bound(matches.begin(), matches.end(), from);
+        return it == matches.end() ? matches.front() : *it;
+    }
+    auto it = lower_bound(matches.begin(), matches.end(), from);
+    return it == matches.begin() ? matches.back() : *(it - 1);
+}
+
+// Helper function to move the selection to a commit, scrolling the history
+// pane only when the commit is off screen (it is then centred)
+void select_commit(int index, int count, int lines_to_display,
+                   int& selected, int& starting_line, int& cursor_position) {
+    selected = index;
+    if (index < starting_line || index >= starting_line + lines_to_display)
+        starting_line = max(min(index - lines_to_display / 2, count - lines_to_display), 0);
+    cursor_position = index - starting_line + 1;
+}
+
+// Helper function to count the occurrences of needle in a blob
+size_t count_in_blob(git_repository* repo, const git_oid& id, const string& needle) {
+    git_blob* blob = NULL;
+    if (git_oid_is_zero(&id) || git_blob_lookup(&blob, repo, &id) < 0) return 0;
+    const char* data = static_cast<const char*>(git_blob_rawcontent(blob));
+    size_t size = git_blob_rawsize(blob);
+    size_t count = 0;
+    const char* end = data + size;
+    while (data < end) {
+        const char* hit = static_cast<const char*>(memmem(data, end - data, needle.data(), needle.size()));
+        if (!hit) break;
+        count++;
+        data = hit + needle.size();
+    }
+    git_blob_free(blob);
+    return count;
+}
+
+// Helper function to tell whether a commit adds or removes occurrences of
+// needle relative to its first parent. Files whose blob didn't change (a
+// mode change) are skipped without being read.
+bool commit_changes_count(git_repository* repo, const git_oid& oid, const string& needle) {
+    git_diff* diff = NULL;
+    if (diff_commit_trees(repo, oid, &diff) < 0) {
+        git_diff_free(diff);
+        return false;
+    }
+    bool changed = false;
+    size_t num_deltas = git_diff_num_deltas(diff);
+    for (size_t i = 0; i < num_deltas && !changed; i++) {
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        if (git_oid_equal(&delta->old_file.id, &delta->new_file.id)) continue;
+        changed = count_in_blob(repo, delta->old_file.id, needle) !=
+                  count_in_blob(repo, delta->new_file.id, needle);
+    }
+    git_diff_free(diff);
+    return changed;
+}
+
+// Pickaxe worker: claims chunks of the snapshot until it runs out or is
+// cancelled, with its own repository handle
+void pickaxe_worker_run(Pickaxe* pickaxe) {
+    name_trace_thread("pickaxe");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, pickaxe->repo_path.c_str()) == 0) {
+        size_t count = pickaxe->oids.size();
+        while (!pickaxe->stop) {
+            size_t begin = pickaxe->next.fetch_add(PICKAXE_CHUNK);
+            if (begin >= count) break;
+            vector<int> hits;
+            for (size_t i = begin; i < min(begin + PICKAXE_CHUNK, count) && !pickaxe->stop; i++) {
+                if (commit_changes_count(repo, pickaxe->oids[i], pickaxe->needle)) hits.push_back(i);
+                pickaxe->scanned++;
+            }
+            lock_guard<mutex> guard(pickaxe->lock);
+            pickaxe->found.insert(pickaxe->found.end(), hits.begin(), hits.end());
+        }
+        git_repository_free(repo);
+    }
+    pickaxe->running--;
+}
+
+// Helper function to start a pickaxe search over the commits loaded so far
+void start_pickaxe(Pickaxe& pickaxe, const char* repo_path, const string& needle,
+                   const CommitStore& store) {
+    pickaxe.repo_path = repo_path;
+    pickaxe.needle = needle;
+    pickaxe.oids = store.oids;
+    int workers = max((int)thread::hardware_concurrency(), 1);
+    pickaxe.running = workers;
+    for (int i = 0; i < workers; i++)
+        pickaxe.workers.emplace_back(pickaxe_worker_run, &pickaxe);
+}
+
+void stop_pickaxe(Pickaxe& pickaxe) {
+    pickaxe.stop = true;
+    for (thread& worker : pickaxe.workers) worker.join();
+    pickaxe.workers.clear();
+}
+
+// Helper function to merge the matches found since the last call into the
+// sorted row list. Returns how many were added.
+size_t drain_pickaxe(Pickaxe& pickaxe, vector<int>& rows) {
+    vector<int> found;
+    {
+        lock_guard<mutex> guard(pickaxe.lock);
+        found.swap(pickaxe.found);
+    }
+    if (found.empty()) return 0;
+    sort(found.begin(), found.end());
+    size_t middle = rows.size();
+    rows.insert(rows.end(), found.begin(), found.end());
+    inplace_merge(rows.begin(), rows.begin() + middle, rows.end());
+    return found.size();
+}
+
+// The churn cache is a header followed by segments, one per save. The
+// header is rewritten after a segment is appended, so a torn append only
+// leaves bytes past size, which are ignored and overwritten next time.
+struct ChurnCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t padding;
+    uint64_t commits;   // Totals over all segments
+    uint64_t files;
+    uint64_t paths;
+    uint64_t size;      // Bytes up to the end of the last complete segment
+};
+
+// Followed by its oids, CommitChurns, FileChurns, path offsets and path arena
+struct ChurnSegmentHeader {
+    uint64_t commits;
+    uint64_t files;
+    uint64_t paths;
+    uint64_t arena_size;
+};
+
+static_assert(sizeof(ChurnCacheHeader) == 48, "churn cache header layout");
+static_assert(sizeof(ChurnSegmentHeader) == 32, "churn segment header layout");
+
+// Helper function to read the churn cache, rejecting anything malformed
+bool load_churn_cache(ChurnCache& cache, const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    string data;
+    char buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) data.append(buffer, got);
+    fclose(file);
+
+    ChurnCacheHeader header;
+    if (data.size() < sizeof(header)) return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, CHURN_CACHE_MAGIC, sizeof(CHURN_CACHE_MAGIC)) != 0 ||
+        header.version != CHURN_CACHE_VERSION || header.size < sizeof(header) || header.size > data.size()) {
+        return false;
+    }
+
+    size_t pos = sizeof(header);
+    while (pos < header.size) {
+        ChurnSegmentHeader segment;
+        if (header.size - pos < sizeof(segment)) return false;
+        memcpy(&segment, data.data() + pos, sizeof(segment));
+        pos += sizeof(segment);
+        uint64_t length = segment.commits * (sizeof(git_oid) + sizeof(CommitChurn)) +
+                          segment.files * sizeof(FileChurn) + segment.paths * sizeof(uint32_t) + segment.arena_size;
+        if (segment.commits > header.commits || segment.files > header.files || segment.paths > header.paths ||
+            length > header.size - pos) {
+            return false;
+        }
+
+        const char* oids = data.data() + pos;
+        const char* churns = oids + segment.commits * sizeof(git_oid);
+        const char* files = churns + segment.commits * sizeof(CommitChurn);
+        const char* offsets = files + segment.files * sizeof(FileChurn);
+        const char* arena = offsets + segment.paths * sizeof(uint32_t);
+        pos += length;
+        size_t first_file = cache.files.size();
+        cache.files.resize(first_file + segment.files);
+        memcpy(cache.files.data() + first_file, files, segment.files * sizeof(FileChurn));
+        for (uint64_t i = 0; i < segment.commits; i++) {
+            git_oid oid;
+            CommitChurn churn;
+            memcpy(&oid, oids + i * sizeof(git_oid), sizeof(git_oid));
+            memcpy(&churn, churns + i * sizeof(CommitChurn), sizeof(CommitChurn));
+            if ((uint64_t)churn.first + churn.count > cache.files.size()) return false;
+            cache.commits.emplace(oid, churn);
+        }
+        for (uint64_t i = 0; i < segment.paths; i++) {
+            uint32_t offset;
+            memcpy(&offset, offsets + i * sizeof(uint32_t), sizeof(uint32_t));
+            if (offset >= segment.arena_size || !memchr(arena + offset, 0, segment.arena_size - offset)) return false;
+            cache.path_ids.emplace(arena + offset, cache.paths.size());
+            cache.paths.push_back(arena + offset);
+        }
+    }
+    if (cache.commits.size() != header.commits || cache.files.size() != header.files ||
+        cache.paths.size() != header.paths) {
+        return false;
+    }
+    for (const FileChurn& churn : cache.files) {
+        if (churn.path >= cache.paths.size()) return false;
+    }
+    cache.file = path;
+    cache.saved_commits = cache.commits.size();
+    cache.saved_files = cache.files.size();
+    cache.saved_paths = cache.paths.size();
+    return true;
+}
+
+// Helper function to encode a segment holding the given commits, and the
+// files and paths from the given indices on
+string churn_segment(const ChurnCache& cache, const vector<git_oid>& oids, size_t first_file, size_t first_path) {
+    ChurnSegmentHeader header;
+    header.commits = oids.size();
+    header.files = cache.files.size() - first_file;
+    header.paths = cache.paths.size() - first_path;
+
+    vector<CommitChurn> churns;
+    for (const git_oid& oid : oids) churns.push_back(cache.commits.at(oid));
+    vector<uint32_t> offsets;
+    string arena;
+    for (size_t i = first_path; i < cache.paths.size(); i++) {
+        offsets.push_back(arena.size());
+        arena.append(cache.paths[i].c_str(), cache.paths[i].size() + 1);
+    }
+    header.arena_size = arena.size();
+
+    string segment((const char*)&header, sizeof(header));
+    segment.append((const char*)oids.data(), oids.size() * sizeof(git_oid));
+    segment.append((const char*)churns.data(), churns.size() * sizeof(CommitChurn));
+    segment.append((const char*)(cache.files.data() + first_file), header.files * sizeof(FileChurn));
+    segment.append((const char*)offsets.data(), offsets.size() * sizeof(uint32_t));
+    segment.append(arena);
+    return segment;
+}
+
+// Helper function to append the commits added since the last save as one
+// segment. Fails when the file no longer holds exactly what this process
+// loaded or saved (another version, or another git-tui appended to it).
+bool append_churn_cache(const ChurnCache& cache, const string& path) {
+    if (cache.file != path) return false;
+    FILE* file = fopen(path.c_str(), "r+b");
+    if (!file) return false;
+    ChurnCacheHeader header;
+    bool ok = fread(&header, 1, sizeof(header), file) == sizeof(header) &&
+              memcmp(header.magic, CHURN_CACHE_MAGIC, sizeof(CHURN_CACHE_MAGIC)) == 0 &&
+              header.version == CHURN_CACHE_VERSION && header.commits == cache.saved_commits &&
+              header.files == cache.saved_files && header.paths == cache.saved_paths;
+    if (ok) {
+        // The segment first, then the header that makes it visible
+        string segment = churn_segment(cache, cache.pending, cache.saved_files, cache.saved_paths);
+        ok = fseek(file, header.size, SEEK_SET) == 0 &&
+             fwrite(segment.data(), 1, segment.size(), file) == segment.size() && fflush(file) == 0;
+        header.commits = cache.commits.size();
+        header.files = cache.files.size();
+        header.paths = cache.paths.size();
+        header.size += segment.size();
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, 1, sizeof(header), file) == sizeof(header);
+    }
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+// Helper function to write the whole churn cache as a single segment
+// through a temp file, so readers never see a partial one
+bool write_churn_cache(const ChurnCache& cache, const string& path) {
+    vector<git_oid> oids;
+    for (const auto& entry : cache.commits) oids.push_back(entry.first);
+    string segment = churn_segment(cache, oids, 0, 0);
+
+    ChurnCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHURN_CACHE_MAGIC, sizeof(CHURN_CACHE_MAGIC));
+    header.version = CHURN_CACHE_VERSION;
+    header.commits = cache.commits.size();
+    header.files = cache.files.size();
+    header.paths = cache.paths.size();
+    header.size = sizeof(header) + segment.size();
+
+    string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(&header, 1, sizeof(header), file) == sizeof(header) &&
+              fwrite(segment.data(), 1, segment.size(), file) == segment.size();
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Helper function to save the commits added since the last save: appended
+// to the file they came from when possible, else a full rewrite
+bool save_churn_cache(ChurnCache& cache, const string& path) {
+    if (!append_churn_cache(cache, path) && !write_churn_cache(cache, path)) return false;
+    cache.pending.clear();
+    cache.file = path;
+    cache.saved_commits = cache.commits.size();
+    cache.saved_files = cache.files.size();
+    cache.saved_paths = cache.paths.size();
+    return true;
+}
+
+// Helper function to look up (or add) the id of a path in the churn cache
+uint32_t intern_churn_path(Analytics& analytics, const char* path) {
+    lock_guard<mutex> guard(analytics.lock);
+    ChurnCache& cache = *analytics.cache;
+    auto it = cache.path_ids.find(path);
+    if (it != cache.path_ids.end()) return it->second;
+    cache.path_ids.emplace(path, cache.paths.size());
+    cache.paths.push_back(path);
+    return cache.paths.size() - 1;
+}
+
+// Helper function to count the lines a commit added and deleted in each
+// file, against its first parent. Binary files count with no lines.
+bool commit_churn(git_repository* repo, Analytics& analytics, const git_oid& oid, vector<FileChurn>& files) {
+    ScopedTimer timer(TIMER_CHURN);
+    git_diff* diff = NULL;
+    if (diff_commit_trees(repo, oid, &diff) < 0) {
+        git_diff_free(diff);
+        return false;
+    }
+    size_t num_deltas = git_diff_num_deltas(diff);
+    for (size_t i = 0; i < num_deltas; i++) {
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        const char* path = delta->status == GIT_DELTA_DELETED ? delta->old_file.path : delta->new_file.path;
+        FileChurn churn = {intern_churn_path(analytics, path), 0, 0};
+        git_patch* patch = NULL;
+        if (git_patch_from_diff(&patch, diff, i) == 0 && patch) {
+            size_t context, added, deleted;
+            git_patch_line_stats(&context, &added, &deleted, patch);
+            churn.added = added;
+            churn.deleted = deleted;
+        }
+        git_patch_free(patch);
+        files.push_back(churn);
+    }
+    git_diff_free(diff);
+    return true;
+}
+
+// Helper function to tell whether a file is the path or lies below it
+bool path_within(const string& file, const string& path) {
+    return file.compare(0, path.size(), path) == 0 && (file.size() == path.size() || file[path.size()] == '/');
+}
+
+// Analytics worker: claims ranges of the snapshot until it runs out or is
+// cancelled, with its own repository handle, and reduces each commit into
+// its own totals
+void analytics_worker_run(Analytics* analytics, AnalyticsTotals* totals) {
+    name_trace_thread("analytics");
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, analytics->repo_path.c_str()) < 0) return;
+    const ChurnCache& cache = *analytics->cache;
+    size_t count = analytics->oids.size();
+    while (!analytics->stop) {
+        size_t begin = analytics->next.fetch_add(ANALYTICS_CHUNK);
+        if (begin >= count) break;
+        for (size_t i = begin; i < min(begin + ANALYTICS_CHUNK, count) && !analytics->stop; i++) {
+            uint64_t author = analytics->authors[i];
+            totals->author_months[author << 32 | analytics->months[i]]++;
+            analytics->analyzed++;
+            if (analytics->merges[i]) continue;
+
+            // Map: the commit's churn, cached or diffed now
+            const FileChurn* files = NULL;
+            size_t file_count = 0;
+            auto cached = cache.commits.find(analytics->oids[i]);
+            if (cached != cache.commits.end()) {
+                files = cache.files.data() + cached->second.first;
+                file_count = cached->second.count;
+            } else {
+                vector<FileChurn>& fresh = analytics->fresh[i];
+                if (!commit_churn(repo, *analytics, analytics->oids[i], fresh)) continue;
+                analytics->diffed[i] = true;   // Each index is written by one worker only
+                analytics->diff_count++;
+                files = fresh.data();
+                file_count = fresh.size();
+            }
+
+            // Reduce into this worker's totals. The cache keeps every file,
+            // so a path-limited run skips the others here, holding the lock
+            // because other workers may be appending to the path table.
+            unique_lock<mutex> paths_guard(analytics->lock, defer_lock);
+            if (!analytics->path.empty()) paths_guard.lock();
+            for (size_t f = 0; f < file_count; f++) {
+                if (paths_guard && !path_within(cache.paths[files[f].path], analytics->path)) continue;
+                FileTotals& file = totals->files[files[f].path];
+                file.added += files[f].added;
+                file.deleted += files[f].deleted;
+                file.commits++;
+                totals->file_authors.insert((uint64_t)files[f].path << 32 | author);
+            }
+        }
+    }
+    git_repository_free(repo);
+}
+
+// Coordinator: loads the cache on the first run, runs the workers, then
+// merges their totals and saves the churn of the newly diffed commits
+void analytics_run(Analytics* analytics) {
+    name_trace_thread("analytics merge");
+    ChurnCache& cache = *analytics->cache;
+    git_repository* repo = NULL;
+    if (git_repository_open(&repo, analytics->repo_path.c_str()) < 0) {
+        const git_error* e = git_error_last();
+        analytics->error = e ? e->message : "unable to open repository";
+        analytics->done = true;
+        return;
+    }
+    vector<string> cache_paths = cache_file_paths(repo, CHURN_CACHE_FILE, ".churn.idx");
+    git_repository_free(repo);
+    if (!cache.loaded) {
+        for (const string& path : cache_paths) {
+            if (load_churn_cache(cache, path)) break;
+            cache = ChurnCache();   // Drop whatever a malformed file left
+        }
+        cache.loaded = true;
+    }
+
+    size_t count = analytics->oids.size();
+    analytics->fresh.resize(count);
+    analytics->diffed.assign(count, false);
+    int workers = max((int)thread::hardware_concurrency(), 1);
+    analytics->partials.resize(workers);
+    vector<thread> threads;
+    for (int i = 0; i < workers; i++)
+        threads.emplace_back(analytics_worker_run, analytics, &analytics->partials[i]);
+    for (thread& worker : threads) worker.join();
+
+    // Merge the partial totals; authors per file are counted from the
+    // union of the (path, author) pairs
+    AnalyticsTotals& totals = analytics->totals;
+    for (AnalyticsTotals& partial : analytics->partials) {
+        for (const auto& entry : partial.author_months) totals.author_months[entry.first] += entry.second;
+        for (const auto& entry : partial.files) {
+            FileTotals& file = totals.files[entry.first];
+            file.added += entry.second.added;
+            file.deleted += entry.second.deleted;
+            file.commits += entry.second.commits;
+        }
+        if (totals.file_authors.empty()) {
+            totals.file_authors.swap(partial.file_authors);
+        } else {
+            totals.file_authors.insert(partial.file_authors.begin(), partial.file_authors.end());
+        }
+        partial = AnalyticsTotals();
+    }
+    for (uint64_t pair : totals.file_authors) totals.files[pair >> 32].authors++;
+    totals.file_authors.clear();
+
+    // Keep what was diffed, even from a cancelled run
+    bool grew = false;
+    for (size_t i = 0; i < count; i++) {
+        if (!analytics->diffed[i]) continue;
+        cache.commits.emplace(analytics->oids[i], CommitChurn{(uint32_t)cache.files.size(),
+                                                              (uint32_t)analytics->fresh[i].size()});
+        cache.files.insert(cache.files.end(), analytics->fresh[i].begin(), analytics->fresh[i].end());
+        cache.pending.push_back(analytics->oids[i]);
+        grew = true;
+    }
+    analytics->fresh.clear();
+    if (grew) {
+        for (const string& path : cache_paths) {
+            if (path != cache_paths.front()) make_cache_dirs(path);
+            if (save_churn_cache(cache, path)) break;
+        }
+    }
+    analytics->done = true;
+}
+
+// Helper function to start analyzing the commits loaded so far, with
+// whatever churn earlier runs cached
+void start_analytics(Analytics& analytics, const char* repo_path, const string& path, const CommitStore& store,
+                     ChurnCache& cache) {
+    analytics.repo_path = repo_path;
+    for (const string& name : path_components(path)) analytics.path += (analytics.path.empty() ? "" : "/") + name;
+    analytics.cache = &cache;
+    analytics.oids = store.oids;
+    analytics.authors = store.authors;
+    analytics.months.resize(store.oids.size());
+    analytics.merges.resize(store.oids.size());
+    for (size_t i = 0; i < store.oids.size(); i++) {
+        time_t time = store.times[i];
+        struct tm date;
+        gmtime_r(&time, &date);
+        analytics.months[i] = (date.tm_year + 1900) * 12 + date.tm_mon;
+        size_t parents = 0;
+        commit_parents(store, i, &parents);
+        analytics.merges[i] = parents > 1;
+    }
+    for (size_t i = 0; i < store.author_names.size(); i++)
+        analytics.author_names.push_back(store.author_names[i] + " <" + store.author_emails[i] + ">");
+    analytics.coordinator = thread(analytics_run, &analytics);
+}
+
+void stop_analytics(Analytics& analytics) {
+    analytics.stop = true;
+    if (analytics.coordinator.joinable()) analytics.coordinator.join();
+}
+
+// Helper function to rank the analyzed files, by lines changed or by
+// authors, ties broken by commits and then path
+vector<uint32_t> rank_files(const Analytics& analytics, bool by_authors, size_t limit) {
+    const auto& files = analytics.totals.files;
+    auto key = [&](uint32_t path) {
+        const FileTotals& file = files.at(path);
+        return make_pair(by_authors ? file.authors : file.added + file.deleted,
+                         (uint64_t)file.commits);
+    };
+    vector<uint32_t> paths;
+    for (const auto& entry : files) paths.push_back(entry.first);
+    auto better = [&](uint32_t a, uint32_t b) {
+        auto ka = key(a), kb = key(b);
+        if (ka != kb) return ka > kb;
+        return analytics.cache->paths[a] < analytics.cache->paths[b];
+    };
+    limit = min(limit, paths.size());
+    partial_sort(paths.begin(), paths.begin() + limit, paths.end(), better);
+    paths.resize(limit);
+    return paths;
+}
+
+// Helper function to list the authors by commits, most first
+vector<pair<uint32_t, uint32_t>> rank_authors(const Analytics& analytics) {
+    unordered_map<uint32_t, uint32_t> commits;
+    for (const auto& entry : analytics.totals.author_months) commits[entry.first >> 32] += entry.second;
+    vector<pair<uint32_t, uint32_t>> authors(commits.begin(), commits.end());
+    sort(authors.begin(), authors.end(), [&](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+        if (a.second != b.second) return a.second > b.second;
+        return analytics.author_names[a.first] < analytics.author_names[b.first];
+    });
+    return authors;
+}
+
+string format_month(uint32_t month) {
+    char text[16];
+    snprintf(text, sizeof(text), "%04u-%02u", month / 12, month % 12 + 1);
+    return text;
+}
+
+// Helper function to quote a CSV field when it needs it
+string csv_field(const string& value) {
+    if (value.find_first_of(",\"\n\r") == string::npos) return value;
+    string quoted = "\"";
+    for (char c : value) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+string json_string(const string& value) {
+    string quoted = "\"";
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// Helper function to write the analytics as CSV (one table, a kind column
+// telling the rows apart) or JSON: commits per author per month, then the
+// files with the most lines changed and those changed by the most authors
+void write_stats(FILE* out, const Analytics& analytics, bool json) {
+    vector<pair<uint32_t, uint32_t>> authors = rank_authors(analytics);
+    map<uint32_t, vector<pair<uint32_t, uint32_t>>> months;   // Author -> (month, commits), by month
+    for (const auto& entry : analytics.totals.author_months)
+        months[entry.first >> 32].emplace_back(entry.first & 0xffffffff, entry.second);
+    for (auto& entry : months) sort(entry.second.begin(), entry.second.end());
+    vector<uint32_t> rankings[2] = {rank_files(analytics, false, ANALYTICS_TOP),
+                                    rank_files(analytics, true, ANALYTICS_TOP)};
+    const char* ranking_names[2] = {"churn", "authors"};
+
+    if (!json) {
+        fprintf(out, "kind,name,month,commits,added,deleted,authors\n");
+        for (const auto& author : authors) {
+            for (const auto& month : months[author.first]) {
+                fprintf(out, "author_month,%s,%s,%u,,,\n", csv_field(analytics.author_names[author.first]).c_str(),
+                        format_month(month.first).c_str(), month.second);
+            }
+        }
+        for (int r = 0; r < 2; r++) {
+            for (uint32_t path : rankings[r]) {
+                const FileTotals& file = analytics.totals.files.at(path);
+                fprintf(out, "%s,%s,,%u,%llu,%llu,%u\n", ranking_names[r], csv_field(analytics.cache->paths[path]).c_str(),
+                        file.commits, (unsigned long long)file.added, (unsigned long long)file.deleted, file.authors);
+            }
+        }
+        return;
+    }
+
+    fprintf(out, "{\n  \"commits\": %zu,\n  \"authors\": [", analytics.oids.size());
+    for (size_t a = 0; a < authors.size(); a++) {
+        fprintf(out, "%s\n    {\"author\": %s, \"commits\": %u, \"months\": {", a ? "," : "",
+                json_string(analytics.author_names[authors[a].first]).c_str(), authors[a].second);
+        const auto& author_months = months[authors[a].first];
+        for (size_t m = 0; m < author_months.size(); m++) {
+            fprintf(out, "%s\"%s\": %u", m ? ", " : "", format_month(author_months[m].first).c_str(),
+                    author_months[m].second);
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n  ]");
+    const char* json_names[2] = {"top_churn", "top_authors"};
+    for (int r = 0; r < 2; r++) {
+        fprintf(out, ",\n  \"%s\": [", json_names[r]);
+        for (size_t i = 0; i < rankings[r].size(); i++) {
+            const FileTotals& file = analytics.totals.files.at(rankings[r][i]);
+            fprintf(out, "%s\n    {\"path\": %s, \"commits\": %u, \"added\": %llu, \"deleted\": %llu, \"authors\": %u}",
+                    i ? "," : "", json_string(analytics.cache->paths[rankings[r][i]]).c_str(), file.commits,
+                    (unsigned long long)file.added, (unsigned long long)file.deleted, file.authors);
+        }
+        fprintf(out, "\n  ]");
+    }
+    fprintf(out, "\n}\n");
+}
+
+// Helper function to truncate string with ellipsis
+string truncate(const string& str, size_t width) {
+    if (str.length() > width)
+        return str.substr(0, width - 3) + "...";
+    return str;
+}
+
+// Helper function to read a bench script: whitespace separated keys, where
+// a key is a name (tab, enter, esc, space, up, down, backspace), a single
+// character, or longer text typed one character at a time. A "*N" suffix
+// repeats the key N times; '#' comments out the rest of a line.
+bool load_bench_script(const char* path, vector<int>& keys) {
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    static const pair<const char*, int> names[] = {
+        {"tab", '\t'}, {"enter", '\n'}, {"esc", 27}, {"space", ' '},
+        {"up", KEY_UP}, {"down", KEY_DOWN}, {"backspace", KEY_BACKSPACE},
+    };
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        string content = line;
+        content = content.substr(0, content.find('#'));
+        istringstream tokens(content);
+        string token;
+        while (tokens >> token) {
+            int repeat = 1;
+            size_t star = token.rfind('*');
+            if (star != string::npos && star > 0 && star + 1 < token.size()) {
+                repeat = max(atoi(token.c_str() + star + 1), 1);
+                token.erase(star);
+            }
+            vector<int> sequence;
+            for (const auto& name : names) {
+                if (token == name.first) sequence.push_back(name.second);
+            }
+            if (sequence.empty()) sequence.assign(token.begin(), token.end());
+            for (int i = 0; i < repeat; i++) keys.insert(keys.end(), sequence.begin(), sequence.end());
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Helper function to time a drawn frame against the key being measured
+void bench_frame_drawn(Bench& bench, chrono::steady_clock::time_point frame_start, bool has_commits,
+                       bool loading) {
+    auto now = chrono::steady_clock::now();
+    if (bench.first_frame_ms < 0 && has_commits)
+        bench.first_frame_ms = chrono::duration<double, milli>(now - bench.start).count();
+    if (bench.loaded_ms < 0 && !loading)
+        bench.loaded_ms = chrono::duration<double, milli>(now - bench.start).count();
+    if (bench.key_in_flight)
+        bench.key_render_ms += chrono::duration<double, milli>(now - frame_start).count();
+}
+
+// Helper function standing in for getch() in a bench run. The next key is
+// only handed out once the previous one's git work has landed on screen;
+// until then this polls, at a finer grain than the UI's own timeouts.
+int bench_read_key(Bench& bench, bool settled) {
+    if (!settled) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        return ERR;
+    }
+    auto now = chrono::steady_clock::now();
+    if (bench.key_in_flight) {
+        bench.total_ms.push_back(chrono::duration<double, milli>(now - bench.key_start).count());
+        bench.render_ms.push_back(bench.key_render_ms);
+        bench.key_in_flight = false;
+    }
+    if (bench.next_key >= bench.keys.size()) {
+        bench.done = true;
+        return ERR;
+    }
+    bench.key_in_flight = true;
+    bench.key_start = now;
+    bench.key_render_ms = 0;
+    return bench.keys[bench.next_key++];
+}
+
+// Helper function to print a sorted sample's percentiles
+void print_bench_row(const char* label, vector<double> samples) {
+    if (samples.empty()) return;
+    sort(samples.begin(), samples.end());
+    size_t p99 = (samples.size() * 99 + 99) / 100 - 1;
+    printf("  %-16s %9.2f %9.2f %9.2f\n", label, samples[(samples.size() - 1) / 2],
+           samples[p99], samples.back());
+}
+
+// Helper function to report a bench run. Git time is what a key waited
+// beyond drawing: the main thread's own git calls and the diff worker.
+void print_bench_report(const Bench& bench, const char* repo_path, size_t commits) {
+    vector<double> git_ms(bench.total_ms.size());
+    for (size_t i = 0; i < git_ms.size(); i++) git_ms[i] = max(bench.total_ms[i] - bench.render_ms[i], 0.0);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("bench: %s (%zu commits, %zu keys)\n", repo_path, commits, bench.total_ms.size());
+    printf("  %-16s %9.2f ms\n", "first frame", bench.first_frame_ms);
+    printf("  %-16s %9.2f ms\n", "history loaded", bench.loaded_ms);
+    printf("  %-16s %9s %9s %9s\n", "per key (ms)", "p50", "p99", "max");
+    print_bench_row("total", bench.total_ms);
+    print_bench_row("git", git_ms);
+    print_bench_row("render", bench.render_ms);
+    printf("  %-16s %9.1f MB\n", "peak RSS", usage.ru_maxrss / 1024.0);
+}
+
+// Helper function to draw the timings overlay: per hot path last/avg/max
+// milliseconds and call counts, then cache hit rates and object counts
+void draw_timings_overlay(WINDOW* overlay, FileListCache& file_cache, size_t prefetched,
+                          DiffStats& diff_stats, size_t commits) {
+    werase(overlay);
+    box(overlay, 0, 0);
+    wattron(overlay, COLOR_PAIR(1));
+    mvwprintw(overlay, 0, 2, "[ Timings (P to close) ]");
+    wattroff(overlay, COLOR_PAIR(1));
 
-void print_usage(const char* program_name) {
-    fprintf(stderr, "Usage: %s <repository_path>\n", program_name);
-    fprintf(stderr, "Example: %s /path/to/git/repo\n", program_name);
+    int line = 1;
+    wattron(overlay, A_BOLD);
+    mvwprintw(overlay, line++, 2, "%-18s %9s %9s %9s %9s", "ms", "last", "avg", "max", "count");
+    wattroff(overlay, A_BOLD);
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        const TimerStat& stat = instruments.timers[i];
+        uint64_t count = stat.count.load();
+        double average = count ? stat.total_ns.load() / 1e6 / count : 0;
+        mvwprintw(overlay, line++, 2, "%-18s %9.2f %9.2f %9.2f %9llu", TIMER_NAMES[i],
+                  stat.last_ns.load() / 1e6, average, stat.max_ns.load() / 1e6, (unsigned long long)count);
+    }
+    line++;
+
+    size_t hits = file_cache.hits.load();
+    size_t misses = file_cache.misses.load();
+    size_t lists, list_bytes;
+    {
+        lock_guard<mutex> guard(file_cache.lock);
+        lists = file_cache.entries.size();
+        list_bytes = file_cache.used_bytes;
+    }
+    size_t memo;
+    {
+        lock_guard<mutex> guard(diff_stats.lock);
+        memo = diff_stats.counted.size();
+    }
+    ssize_t cached_bytes = 0, cache_limit = 0;
+    git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cached_bytes, &cache_limit);
+
+    mvwprintw(overlay, line++, 2, "file lists: %zu cached (%.1f MB), %.0f%% hits (%zu/%zu), %zu prefetched",
+              lists, list_bytes / 1048576.0, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+              hits, hits + misses, prefetched);
+    mvwprintw(overlay, line++, 2, "commits: %zu   line stats memo: %zu", commits, memo);
+    mvwprintw(overlay, line++, 2, "libgit2 object cache: %.1f / %.1f MB",
+              cached_bytes / 1048576.0, cache_limit / 1048576.0);
+    wnoutrefresh(overlay);
 }
 
-// Callback function to collect diff content
-int diff_line_callback(const git_diff_delta *delta, const git_diff_hunk *hunk, 
-                      const git_diff_line *line, void *payload) {
-    vector<string>* diff_lines = static_cast<vector<string>*>(payload);
-    
-    char prefix;
-    switch (line->origin) {
-        case GIT_DIFF_LINE_ADDITION: prefix = '+'; break;
-        case GIT_DIFF_LINE_DELETION: prefix = '-'; break;
-        case GIT_DIFF_LINE_CONTEXT: prefix = ' '; break;
-        case GIT_DIFF_LINE_FILE_HDR: prefix = 'F'; break;
-        case GIT_DIFF_LINE_HUNK_HDR: prefix = 'H'; break;
-        default: prefix = ' '; break;
+// Helper function to draw the analytics overlay: progress while the
+// workers run, then the authors' commits over the last months and the two
+// file rankings, as many rows of each as fit
+void draw_analytics_overlay(WINDOW* overlay, const Analytics& analytics) {
+    int height, width;
+    getmaxyx(overlay, height, width);
+    werase(overlay);
+    box(overlay, 0, 0);
+    wattron(overlay, COLOR_PAIR(1));
+    mvwprintw(overlay, 0, 2, "[ Analytics (A to close) ]");
+    wattroff(overlay, COLOR_PAIR(1));
+
+    size_t count = analytics.oids.size();
+    if (!analytics.done) {
+        size_t analyzed = analytics.analyzed.load();
+        mvwprintw(overlay, 2, 2, "Analyzing %zu / %zu commits (%zu diffed, the rest from the cache)...",
+                  analyzed, count, analytics.diff_count.load());
+        wnoutrefresh(overlay);
+        return;
     }
-    
-    string diff_line;
-    if (prefix == 'F' || prefix == 'H') {
-        diff_line = string(line->content, line->content_len);
-    } else {
-        diff_line = prefix + string(line->content, line->content_len);
+    // The error and the totals are only read once done publishes them
+    if (!analytics.error.empty()) {
+        mvwprintw(overlay, 2, 2, "Error: %s", analytics.error.c_str());
+        wnoutrefresh(overlay);
+        return;
     }
-    
-    // Remove trailing newlines
-    if (!diff_line.empty() && diff_line.back() == '\n') {
-        diff_line.pop_back();
+
+    vector<pair<uint32_t, uint32_t>> authors = rank_authors(analytics);
+    mvwprintw(overlay, 1, 2, "%zu commits by %zu authors, %zu files changed (%zu commits diffed, the rest cached)",
+              count, authors.size(), analytics.totals.files.size(), analytics.diff_count.load());
+    int rows = max((height - 10) / 3, 1);
+    int author_width = max(width - 4 - (ANALYTICS_MONTHS + 1) * 8, 16);   // Next to a column per month and the total
+    int path_width = max(width - 4 - 38, 16);                             // Next to the four counts
+    int line = 3;
+
+    uint32_t newest = count ? *max_element(analytics.months.begin(), analytics.months.end()) : 0;
+    wattron(overlay, A_BOLD);
+    mvwprintw(overlay, line, 2, "%-*s", author_width, "Commits per author");
+    for (int m = ANALYTICS_MONTHS - 1; m >= 0; m--) wprintw(overlay, " %7s", format_month(newest - m).c_str());
+    wprintw(overlay, " %7s", "total");
+    wattroff(overlay, A_BOLD);
+    line++;
+    for (int a = 0; a < (int)authors.size() && a < rows; a++, line++) {
+        mvwprintw(overlay, line, 2, "%-*s", author_width,
+                  truncate(analytics.author_names[authors[a].first], author_width - 1).c_str());
+        for (int m = ANALYTICS_MONTHS - 1; m >= 0; m--) {
+            auto it = analytics.totals.author_months.find((uint64_t)authors[a].first << 32 | (newest - m));
+            wprintw(overlay, " %7u", it == analytics.totals.author_months.end() ? 0 : it->second);
+        }
+        wprintw(overlay, " %7u", authors[a].second);
     }
-    
-    diff_lines->push_back(diff_line);
-    return 0;
+    line++;
+
+    const char* titles[2] = {"Most lines changed", "Changed by the most authors"};
+    for (int r = 0; r < 2; r++) {
+        wattron(overlay, A_BOLD);
+        mvwprintw(overlay, line++, 2, "%-*s %9s %9s %8s %8s", path_width, titles[r], "added", "deleted",
+                  "commits", "authors");
+        wattroff(overlay, A_BOLD);
+        for (uint32_t path : rank_files(analytics, r == 1, rows)) {
+            const FileTotals& file = analytics.totals.files.at(path);
+            mvwprintw(overlay, line++, 2, "%-*s ", path_width, truncate(analytics.cache->paths[path], path_width).c_str());
+            wattron(overlay, COLOR_PAIR(1));
+            wprintw(overlay, "%9llu ", (unsigned long long)file.added);
+            wattroff(overlay, COLOR_PAIR(1));
+            wattron(overlay, COLOR_PAIR(5));
+            wprintw(overlay, "%9llu", (unsigned long long)file.deleted);
+            wattroff(overlay, COLOR_PAIR(5));
+            wprintw(overlay, " %8u %8u", file.commits, file.authors);
+        }
+        line++;
+    }
+    wnoutrefresh(overlay);
 }
-// Helper function to format timestamp
-string format_time(time_t timestamp) {
-    struct tm* timeinfo = localtime(&timestamp);
-    stringstream ss;
-    ss << put_time(timeinfo, "%Y-%m-%d %H:%M:%S");
-    return ss.str();
+
+// Headless --stats: walks the history as the UI would, analyzes all of it
+// and writes the result to stdout
+int export_stats(const char* repo_path, const string& path_filter, const string& refs_glob, bool refs_with_head,
+                 bool json) {
+    git_libgit2_init();
+    CommitLoader loader;
+    start_commit_loader(loader, repo_path, path_filter, refs_glob, refs_with_head);
+    loader.worker.join();
+    CommitStore commits;
+    vector<Decoration> decorations;
+    drain_commit_loader(loader, commits, decorations);
+    if (!loader.error.empty()) {
+        fprintf(stderr, "Cannot walk history: %s\n", loader.error.c_str());
+        git_libgit2_shutdown();
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    ChurnCache cache;
+    Analytics analytics;
+    start_analytics(analytics, repo_path, path_filter, commits, cache);
+    analytics.coordinator.join();
+    if (!analytics.error.empty()) {
+        fprintf(stderr, "Cannot analyze history: %s\n", analytics.error.c_str());
+        git_libgit2_shutdown();
+        return 1;
+    }
+    write_stats(stdout, analytics, json);
+    fprintf(stderr, "%zu commits analyzed in %.0f ms, %zu diffed, the rest from the cache\n",
+            analytics.oids.size(),
+            chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(),
+            analytics.diff_count.load());
+    git_libgit2_shutdown();
+    return 0;
 }
 
-// Helper function to truncate string with ellipsis
-string truncate(const string& str, size_t width) {
-    if (str.length() > width)
-        return str.substr(0, width - 3) + "...";
-    return str;
+// Helper function to draw the blame view in the diff pane: each hunk's
+// commit, author and date in a gutter on its first line, then the line
+void draw_blame_view(WINDOW* diff_window, BlameJobs& jobs, BlameView& view, int lines_to_display,
+                     bool focused) {
+    const int content_start_y = 2;
+    const int left_padding = 3;
+    const int gutter = 8 + 1 + 12 + 1 + 10 + 2;
+    int width = getmaxx(diff_window);
+    werase(diff_window);
+
+    lock_guard<mutex> guard(jobs.lock);
+    const BlameFile& file = *view.file;
+    int rows = file.line_hunks.size();
+    view.starting_line = max(min(view.starting_line, rows - lines_to_display), 0);
+    for (int i = view.starting_line; i < view.starting_line + lines_to_display && i < rows; i++) {
+        int y = content_start_y + i - view.starting_line;
+        int hunk = file.line_hunks[i];
+        if (hunk == BLAME_PENDING) {
+            wattron(diff_window, A_DIM);
+            mvwprintw(diff_window, y, left_padding, "...");
+            wattroff(diff_window, A_DIM);
+        } else if (hunk >= 0 && (i == view.starting_line || file.line_hunks[i - 1] != hunk)) {
+            const BlameHunk& blamed = file.hunks[hunk];
+            char id[9];
+            git_oid_tostr(id, sizeof(id), &blamed.commit);
+            wattron(diff_window, COLOR_PAIR(3));
+            mvwprintw(diff_window, y, left_padding, "%s", id);
+            wattroff(diff_window, COLOR_PAIR(3));
+            wprintw(diff_window, " %-12.12s %s", blamed.author.c_str(), format_time(blamed.time).substr(0, 10).c_str());
+        }
+        int room = width - 1 - left_padding - gutter;
+        int length = min((int)(file.offsets[i + 1] - file.offsets[i]), max(room, 0));
+        mvwprintw(diff_window, y, left_padding + gutter, "%.*s", length, file.bytes.data() + file.offsets[i]);
+    }
+
+    if (!file.loaded) {
+        wattron(diff_window, A_DIM);
+        mvwprintw(diff_window, content_start_y, left_padding, "computing...");
+        wattroff(diff_window, A_DIM);
+    } else if (rows == 0 && !file.error.empty()) {
+        wattron(diff_window, COLOR_PAIR(5));
+        mvwprintw(diff_window, content_start_y, left_padding, "%s", file.error.c_str());
+        wattroff(diff_window, COLOR_PAIR(5));
+    }
+
+    if (focused && rows > 0) {
+        mvwchgat(diff_window, content_start_y + view.cursor_position - 1, 1, width - 2, A_REVERSE, 2, NULL);
+    }
+
+    box(diff_window, 0, 0);
+    wattron(diff_window, COLOR_PAIR(1));
+    // A failed jump, or a blame that failed after the file was read
+    const string& note = !view.note.empty() ? view.note : rows > 0 ? file.error : "";
+    mvwprintw(diff_window, 0, 2, "[ Blame: %s @ %.8s%s%s ]", file.path.c_str(), git_oid_tostr_s(&file.commit),
+              note.empty() ? "" : " - ", note.c_str());
+    wattroff(diff_window, COLOR_PAIR(1));
+    wnoutrefresh(diff_window);
 }
 
 // Helper function to create a horizontal line
@@ -84,32 +4743,111 @@ void draw_horizontal_line(WINDOW* win, int y, int x, int width, char ch = '-') {
 }
 
 int main(int argc, char* argv[]) {
+    Bench bench;
+    bench.start = chrono::steady_clock::now();
 
-    if (argc != 2) {
+    // Get repository path and options from command line
+    const char* repo_path = NULL;
+    const char* bench_script = NULL;
+    string stats_format;          // --stats: export and exit, without a screen
+    string trace_path;
+    size_t file_cache_mb = DEFAULT_FILE_CACHE_MB;
+    int prefetch_depth = DEFAULT_PREFETCH_DEPTH;
+    size_t diff_limit = (size_t)DEFAULT_DIFF_LIMIT_MB << 20;
+    RenameLimits renames;
+    string path_filter;
+    string refs_glob;             // History of these refs instead of HEAD's
+    bool refs_with_head = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0 && i + 2 == argc) {
+            path_filter = argv[++i];
+        } else if (strcmp(argv[i], "--all") == 0) {
+            refs_glob = "refs/*";
+            refs_with_head = true;
+        } else if (strcmp(argv[i], "--refs") == 0 && i + 1 < argc) {
+            // Spelled like git log --glob: refs/ is implied, and a glob
+            // without wildcards means everything below it
+            refs_glob = argv[++i];
+            if (refs_glob.compare(0, 5, "refs/") != 0) refs_glob = "refs/" + refs_glob;
+            if (refs_glob.find_first_of("?*[") == string::npos) refs_glob += "/*";
+            refs_with_head = false;
+        } else if (strcmp(argv[i], "--file-cache-mb") == 0 && i + 1 < argc) {
+            file_cache_mb = max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            prefetch_depth = max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--diff-limit-mb") == 0 && i + 1 < argc) {
+            diff_limit = (size_t)max(atoi(argv[++i]), 1) << 20;
+        } else if (strcmp(argv[i], "--rename-limit") == 0 && i + 1 < argc) {
+            renames.candidates = max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--rename-ms") == 0 && i + 1 < argc) {
+            renames.budget_ms = max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+            instruments.tracing = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench.enabled = true;
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            bench_script = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "csv") == 0 || strcmp(argv[i + 1], "json") == 0)) {
+            stats_format = argv[++i];
+        } else if (!repo_path && argv[i][0] != '-') {
+            repo_path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!repo_path || (bench_script && !bench.enabled)) {
         print_usage(argv[0]);
         return 1;
     }
+    if (bench_script && !load_bench_script(bench_script, bench.keys)) {
+        fprintf(stderr, "Cannot read bench script %s\n", bench_script);
+        return 1;
+    }
+    if (!stats_format.empty()) {
+        int status = export_stats(repo_path, path_filter, refs_glob, refs_with_head, stats_format == "json");
+        if (instruments.tracing && !write_trace(trace_path)) {
+            fprintf(stderr, "Cannot write trace to %s\n", trace_path.c_str());
+            return 1;
+        }
+        return status;
+    }
+
+    name_trace_thread("ui");
 
-    // Get repository path from command line
-    const char* repo_path = argv[1];
-    // Initialize ncurses
-    initscr();
+    // Initialize ncurses; a bench run draws to a fixed-size screen that
+    // goes nowhere, so rendering is still timed without a terminal
+    if (bench.enabled) {
+        setenv("LINES", to_string(BENCH_LINES).c_str(), 1);
+        setenv("COLUMNS", to_string(BENCH_COLUMNS).c_str(), 1);
+        FILE* null_out = fopen("/dev/null", "w");
+        FILE* null_in = fopen("/dev/null", "r");
+        if (!null_out || !null_in || !newterm("xterm", null_out, null_in)) {
+            fprintf(stderr, "Cannot set up a headless screen for --bench\n");
+            return 1;
+        }
+    } else {
+        initscr();
+    }
     start_color();
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
+    set_escdelay(25);   // Esc closes the search prompt; don't wait a second for it
     
     // Initialize color pairs
     init_pair(1, COLOR_GREEN, COLOR_BLACK);  // For headers
     init_pair(2, COLOR_CYAN, COLOR_BLACK);   // For highlights
     init_pair(3, COLOR_YELLOW, COLOR_BLACK); // For commit IDs
     init_pair(4, COLOR_WHITE, COLOR_BLACK);  // For normal text
+    init_pair(5, COLOR_RED, COLOR_BLACK);    // For deleted line counts
+    init_pair(6, COLOR_MAGENTA, COLOR_BLACK); // For numbers and preprocessor lines in diffs
 
-    vector<CommitInfo> commitList;
+    CommitStore commitList;
     git_libgit2_init();
     git_repository* repo = NULL;
-    git_revwalk* walker = NULL;
-    git_commit* commit = NULL;
 
     // Get terminal dimensions
     int maxX, maxY;
@@ -130,79 +4868,39 @@ int main(int argc, char* argv[]) {
     scrollok(win, TRUE);
     scrollok(commit_info_window, TRUE);
     scrollok(files_changed, TRUE);
-    refresh();
 
-    // Draw windows with borders and titles
-    box(win, 0, 0);
-    wattron(win, COLOR_PAIR(1));
-    mvwprintw(win, 0, 2, "[ Commit History ]");
-    wattroff(win, COLOR_PAIR(1));
-    wrefresh(win);
-
-    box(commit_info_window, 0, 0);
-    wattron(commit_info_window, COLOR_PAIR(1));
-    mvwprintw(commit_info_window, 0, 2, "[ Commit Details ]");
-    wattroff(commit_info_window, COLOR_PAIR(1));
-    wrefresh(commit_info_window);
-
-    box(files_changed, 0, 0);
-    wattron(files_changed, COLOR_PAIR(1));
-    mvwprintw(files_changed, 0, 2, "[ Files Changed ]");
-    wattroff(files_changed, COLOR_PAIR(1));
-    wrefresh(files_changed);
-
-    box(diff_window, 0, 0);
-    wattron(diff_window, COLOR_PAIR(1));
-    mvwprintw(diff_window, 0, 2, "[ Git Diff ]");
-    wattroff(diff_window, COLOR_PAIR(1));
-    wrefresh(diff_window);
+    // Timings overlay, toggled with 'P' and drawn over the middle of the screen
+    int overlay_width = min(80, maxX);
+    int overlay_height = min(TIMER_COUNT + 7, maxY);
+    WINDOW* timings_overlay = newwin(overlay_height, overlay_width, (maxY - overlay_height) / 2,
+                                     (maxX - overlay_width) / 2);
+    bool show_timings = false;
 
+    // Analytics overlay, toggled with 'A' over the middle of the screen
+    int analytics_width = min(120, maxX - 4);
+    WINDOW* analytics_overlay = newwin(maxY - 4, analytics_width, 2, (maxX - analytics_width) / 2);
+    bool show_analytics = false;
+    refresh();
 
-    // Open repository and initialize walker
+    // Open repository for diffs on the UI thread; history is walked in the background
+    string repo_error;
     int error = git_repository_open(&repo, repo_path);
     if (error < 0) {
         const git_error* e = git_error_last();
-        mvwprintw(status_bar, 0, 0, "Error: %s", e->message);
-        wrefresh(status_bar);
-    }
-
-    if (git_revwalk_new(&walker, repo) < 0) {
-        const git_error* e = git_error_last();
-        mvwprintw(status_bar, 0, 0, "Error: %s", e->message);
-        wrefresh(status_bar);
+        repo_error = e ? e->message : "unable to open repository";
     }
 
-    git_revwalk_push_head(walker);
-    git_revwalk_sorting(walker, GIT_SORT_TIME);
-    git_oid oid;
+    CommitLoader loader;
+    start_commit_loader(loader, repo_path, path_filter, refs_glob, refs_with_head);
     int commit_message_count = 0;
-
-    // Collect commit information
-    while (git_revwalk_next(&oid, walker) == 0) {
-        if (git_commit_lookup(&commit, repo, &oid) == 0) {
-            CommitInfo info;
-            info.message = git_commit_message(commit);
-            info.author = git_commit_author(commit)->name;
-            info.email = git_commit_author(commit)->email;
-            info.commit_time = git_commit_time(commit);
-            info.commit_id = git_oid_tostr_s(&oid);
-            commitList.push_back(info);
-        }
-        commit_message_count++;
-        git_commit_free(commit);
-    }
+    bool loading = true;
 
     int starting_line = 0;
     int lines_to_display = commit_window_size - 2;
     int cursor_position = 1;
     int commit_info_window_count = 0;
-
-    // Status bar initial update
-    wattron(status_bar, COLOR_PAIR(2));
-    mvwprintw(status_bar, 0, 0, " [^/j]Up [v/k]Down [q]Quit | Total Commits: %d", commit_message_count);
-    wattroff(status_bar, COLOR_PAIR(2));
-    wrefresh(status_bar);
-    
+    string selected_message;
+    int selected_message_index = -1;
 
     int files_starting_line = 0;
     int files_cursor_position = 1;
@@ -210,406 +4908,1088 @@ int main(int argc, char* argv[]) {
     int window_flag = 0;
 
     DiffContent diff_content;
+    diff_content.limit = diff_limit;
     diff_content.starting_line = 0;
     diff_content.cursor_position = 1;
     diff_content.lines_to_display = 2 * maxY/3 - 5;
+    diff_content.old_id = diff_content.new_id = git_oid();
     string current_diff_file = "";  // Track currently displayed diff file
+    DiffHighlight diff_highlight;
+    HighlightCache highlight_cache;
+    vector<vector<TokenSpan>> highlight_rows;
+    DiffWords diff_words;
+    SideBySide side_by_side;
+    bool side_by_side_view = false;   // Toggled by 's'
+
+    FileListCache file_cache;
+    file_cache.capacity_bytes = file_cache_mb * 1024 * 1024;
+    file_cache.renames = renames;
+    shared_ptr<const ChangedFiles> changed_files;
+    int files_commit_index = -1;   // Commit whose changed files are shown
+    int diff_commit_index = -1;    // Commit whose diff is shown
+    int scroll_direction = 1;      // Last commit-list move, steers the prefetch window
+
+    // Diffs for the selection are built on a worker; the panes show
+    // "computing..." until the result for the current selection arrives
+    DiffJobs diff_jobs;
+    start_diff_jobs(diff_jobs, repo_path, file_cache);
+    bool files_pending = false;
+    bool diff_pending = false;
+
+    // 'b' in the diff pane swaps the diff for a blame of the file, blamed
+    // around the view as it scrolls
+    BlameJobs blame_jobs;
+    start_blame_jobs(blame_jobs, repo_path);
+    BlameView blame_view;
+    bool blame_pending = false;
+    unsigned shown_blames = 0;
+
+    CommitSearch search;
+    bool search_changed = false;   // Query edited; searched once per batch of keys
+
+    // Pickaxe results replace the history pane with a filtered view whose
+    // rows map to commits through pickaxe_rows
+    unique_ptr<Pickaxe> pickaxe;
+
+    // Analysis of the history for the 'A' overlay; the churn cache outlives
+    // each run, so running again after new commits only diffs those
+    unique_ptr<Analytics> analytics;
+    ChurnCache churn_cache;
+    const Analytics* analytics_drawn = NULL;   // Whose finished result the overlay holds
+    bool pickaxe_view = false;
+    vector<int> pickaxe_rows;
+    LaneGraph lane_graph;
+    vector<string> graph_rows;
+    vector<Decoration> decorations;   // Ref labels, from the loader
 
-    vector<string> file_changed_list;
+    // Commits made, fetched or checked out while the history is open are
+    // picked up from the refs (not in --bench, which replays a fixed repo)
+    RefsWatch refs_watch;
+    if (!bench.enabled && repo) open_refs_watch(refs_watch, repo);
+    HistoryRefresh history_refresh;
+    bool refreshing = false;
+    vector<RefTip> history_tips;   // Where the listed history was walked from
+    bool reselect = false;         // After walking everything again, select
+    git_oid reselect_oid;          // this commit as soon as it is listed
+
+    // 'w' swaps the changed files of the selected commit for the working
+    // tree's staged and unstaged changes; the status worker starts then
+    WorktreeStatus worktree;
+    bool worktree_started = false;
+    bool worktree_view = false;
+    bool worktree_scanning = false;
+    bool worktree_watching = false;
+    shared_ptr<const ChangedFiles> worktree_files;   // Latest list from the worker
+    size_t worktree_files_staged = 0;
+    size_t worktree_staged = 0;    // Rows of the shown list that are staged changes
+    unsigned shown_worktree = 0;   // Version of the list last taken from the worker
+    bool worktree_rediff = false;  // The shown file may have changed on disk
+
+    Prefetcher prefetcher;
+    if (prefetch_depth > 0) start_prefetcher(prefetcher, repo_path, file_cache);
+
+    // +N -M columns fill in as the diffstat worker counts them; the total
+    // goes in the pane title once every file of the commit is counted
+    DiffStats diff_stats;
+    start_diff_stats(diff_stats, repo_path);
+    shared_ptr<const ChangedFiles> stats_list;   // List and row the worker was last queued for
+    int stats_start = -1;
+    bool stats_complete = false;
+    LineStats stats_total;
+    size_t shown_computed = 0;
+    unsigned dirty = PANE_ALL;
+    string history_source = refs_with_head ? "--all" : refs_glob;
+    if (!path_filter.empty()) history_source += (history_source.empty() ? "" : " -- ") + path_filter;
+    string history_title = history_source.empty() ? "[ Commit History ]" : "[ Commit History: " + history_source + " ]";
+    size_t shown_prefetched = 0;  // Prefetch count last drawn in the status bar
     // Main program loop
     while (1) {
+        // Pick up whatever the background revwalk produced since the last frame
+        if (loading) {
+            int loaded_before = commitList.oids.size();
+            size_t labels_before = decorations.size();
+            drain_commit_loader(loader, commitList, decorations);
+            if (loader.done) {
+                drain_commit_loader(loader, commitList, decorations);
+                loader.worker.join();
+                loading = false;
+                history_tips = loader.tips;
+                lock_guard<mutex> guard(loader.lock);
+                if (repo_error.empty()) repo_error = loader.error;
+                dirty |= PANE_HISTORY | PANE_STATUS;
+            }
+            if (reselect) {
+                for (size_t i = loaded_before; i < commitList.oids.size(); i++) {
+                    if (git_oid_equal(&commitList.oids[i], &reselect_oid)) {
+                        select_commit(i, commitList.oids.size(), lines_to_display,
+                                      commit_info_window_count, starting_line, cursor_position);
+                        reselect = false;
+                        break;
+                    }
+                }
+                if (!loading) reselect = false;
+            }
+            if ((int)commitList.oids.size() != loaded_before) dirty |= PANE_HISTORY | PANE_STATUS;
+            if (decorations.size() != labels_before) dirty |= PANE_HISTORY;
+            if (!path_filter.empty()) dirty |= PANE_STATUS;   // Walked count moves on its own
+            if (loaded_before == 0 && !commitList.oids.empty()) dirty |= PANE_DETAILS;
+        }
+
+        // Refresh the history once the refs have settled after a change, and
+        // not under a running walk or pickaxe search, whose rows would move
+        if (drain_refs_watch(refs_watch) && worktree_started) {
+            lock_guard<mutex> guard(worktree.lock);
+            worktree.index_dirty = true;   // HEAD may have moved under the staged changes
+        }
+        if (refs_watch.changed && !loading && !refreshing && !(pickaxe && !pickaxe->workers.empty()) &&
+            chrono::steady_clock::now() - refs_watch.last_change >= chrono::milliseconds(REFRESH_SETTLE_MS)) {
+            refs_watch.changed = false;
+            start_history_refresh(history_refresh, loader, history_tips);
+            refreshing = true;
+        }
+        if (refreshing && history_refresh.done) {
+            history_refresh.worker.join();
+            refreshing = false;
+            if (!history_refresh.error.empty()) {
+                // No refs to walk right now (e.g. mid-rebase); keep what is listed
+            } else if (history_refresh.reload) {
+                // A ref moved backwards or sideways: walk everything again,
+                // coming back to the selected commit once it is listed again
+                reselect = commit_message_count > 0;
+                if (reselect)
+                    reselect_oid = commitList.oids[row_commit(pickaxe_view ? &pickaxe_rows : NULL, commit_info_window_count)];
+                if (pickaxe) stop_pickaxe(*pickaxe);
+                pickaxe.reset();
+                pickaxe_view = false;
+                pickaxe_rows.clear();
+                commitList = CommitStore();
+                lane_graph = LaneGraph();
+                search.matches.clear();
+                search.folded_arena.clear();
+                search.origin = 0;
+                commit_info_window_count = 0;
+                starting_line = 0;
+                cursor_position = 1;
+                selected_message_index = -1;
+                files_commit_index = -1;
+                diff_commit_index = -1;
+                decorations.clear();
+                start_commit_loader(loader, repo_path, path_filter, refs_glob, refs_with_head);
+                loading = true;
+            } else {
+                // Only new commits: they go on top, and every row index moves
+                // down by as many, so the cursor and the cached diffs stay put.
+                // A cursor on the first screen stays on it; otherwise the
+                // view scrolls along with the cursor.
+                int added = history_refresh.commits.oids.size();
+                prepend_commits(commitList, history_refresh.commits);
+                decorations.swap(history_refresh.decorations);
+                history_tips = history_refresh.tips;
+                if (added > 0) {
+                    lane_graph = LaneGraph();
+                    if (pickaxe_view) {
+                        for (int& row : pickaxe_rows) row += added;
+                    } else {
+                        int shift = starting_line == 0 && cursor_position + added <= lines_to_display ? 0 : added;
+                        commit_info_window_count += added;
+                        starting_line += shift;
+                        cursor_position += added - shift;
+                        for (int& match : search.matches) match += added;
+                        search.origin += added;
+                    }
+                    if (selected_message_index >= 0) selected_message_index += added;
+                    if (files_commit_index >= 0) files_commit_index += added;
+                    if (diff_commit_index >= 0) diff_commit_index += added;
+                }
+            }
+            dirty |= PANE_ALL;
+        }
+
+        // Stream pickaxe matches into the filtered view, keeping the cursor
+        // on the same commit as rows are inserted above it
+        if (pickaxe && !pickaxe->workers.empty()) {
+            bool finished = pickaxe->running == 0;   // Checked first: no match can land after
+            int selected = pickaxe_rows.empty() ? -1 : pickaxe_rows[commit_info_window_count];
+            if (drain_pickaxe(*pickaxe, pickaxe_rows) > 0 && selected >= 0) {
+                int row = lower_bound(pickaxe_rows.begin(), pickaxe_rows.end(), selected) - pickaxe_rows.begin();
+                starting_line += row - commit_info_window_count;
+                commit_info_window_count = row;
+                search.matches.clear();   // Rows moved under the last search
+            }
+            if (finished) stop_pickaxe(*pickaxe);
+            dirty |= PANE_HISTORY | PANE_DETAILS | PANE_STATUS;
+        }
+        const vector<int>* view_rows = pickaxe_view ? &pickaxe_rows : NULL;
+        bool show_graph = !pickaxe_view && path_filter.empty();
+        commit_message_count = pickaxe_view ? pickaxe_rows.size() : commitList.oids.size();
+
         cursor_position = max(min(cursor_position, commit_window_size - 2), 1);
         starting_line = max(min(starting_line, commit_message_count - lines_to_display), 0);
+        int selected_commit = commit_message_count > 0 ? row_commit(view_rows, commit_info_window_count) : -1;
 
-        // Refresh commit history window
-        werase(win);
-        box(win, 0, 0);
-        wattron(win, COLOR_PAIR(1));
-        mvwprintw(win, 0, 2, "[ Commit History ]");
-        wattroff(win, COLOR_PAIR(1));
+        // Pick up the diff worker's result; results for an older selection
+        // were voided when the newer job was posted
+        DiffJob finished;
+        shared_ptr<const ChangedFiles> job_files;
+        shared_ptr<const DiffText> job_text;
+        if ((files_pending || diff_pending) && take_diff_result(diff_jobs, finished, job_files, job_text)) {
+            if (finished.file_index < 0) {
+                changed_files = job_files;
+                files_pending = false;
+                dirty |= PANE_FILES | PANE_STATUS;
+            } else {
+                diff_content.text = job_text;
+                diff_content.old_id = finished.file.old_id;
+                diff_content.new_id = finished.file.new_id;
+                diff_pending = false;
+                // A working-tree file shown again after a change may be shorter now
+                diff_content.starting_line = max(min(diff_content.starting_line,
+                                                     diff_pane_rows(side_by_side_view ? &side_by_side : NULL, job_text) -
+                                                     diff_content.lines_to_display), 0);
+                dirty |= PANE_DIFF;
+            }
+        }
+
+        // Take the working tree's latest list, keeping the cursor on the same
+        // file; the shown diff is built again, as the file may have changed
+        if (worktree_started) {
+            bool updated = false;
+            {
+                lock_guard<mutex> guard(worktree.lock);
+                if (worktree.version != shown_worktree) {
+                    shown_worktree = worktree.version;
+                    worktree_files = worktree.files;
+                    worktree_files_staged = worktree.staged;
+                    worktree_scanning = worktree.scanning;
+                    worktree_watching = worktree.watching;
+                    if (repo_error.empty()) repo_error = worktree.error;
+                    updated = true;
+                }
+            }
+            if (updated && worktree_view && worktree_files) {
+                const ChangedFiles* files = worktree_files.get();
+                size_t staged = worktree_files_staged;
+                int selected_row = files_starting_line + files_cursor_position - 1;
+                int row = -1;
+                if (changed_files && selected_row < (int)changed_files->files.size()) {
+                    const string& path = changed_files->files[selected_row].new_path;
+                    bool was_staged = selected_row < (int)worktree_staged;
+                    for (int i = 0; i < (int)files->files.size() && row < 0; i++) {
+                        if (files->files[i].new_path == path && (i < (int)staged) == was_staged) row = i;
+                    }
+                }
+                if (row >= 0 && row != selected_row) {
+                    files_starting_line = max(files_starting_line + row - selected_row, 0);
+                    files_cursor_position = row - files_starting_line + 1;
+                }
+                changed_files = worktree_files;
+                worktree_staged = staged;
+                worktree_rediff = true;
+                dirty |= PANE_FILES | PANE_DIFF | PANE_STATUS;
+            } else if (updated) {
+                dirty |= PANE_FILES | PANE_STATUS;
+            }
+        }
+
+        // Changed files only have to be fetched again when the selected commit
+        // changes; a cache miss is diffed on the worker
+        if (!worktree_view && commit_message_count > 0 && files_commit_index != selected_commit) {
+            const git_oid& oid = commitList.oids[selected_commit];
+            changed_files = find_changed_files(file_cache, oid);
+            if (files_pending || diff_pending) cancel_diff_job(diff_jobs);
+            if (diff_pending) current_diff_file = "";  // Its patch is never coming
+            diff_pending = false;
+            files_pending = !changed_files;
+            if (changed_files) {
+                file_cache.hits++;
+            } else {
+                post_diff_job(diff_jobs, oid, -1, 0);
+            }
+            files_commit_index = selected_commit;
+            if (prefetch_depth > 0)
+                prefetch_around(prefetcher, commitList, view_rows, commit_message_count,
+                                commit_info_window_count, scroll_direction, prefetch_depth);
+            dirty |= PANE_FILES | PANE_STATUS;
+        }
+
+        // Counts landing for the shown list redraw its rows
+        if (changed_files && !stats_complete && diff_stats.computed.load() != shown_computed) {
+            shown_computed = diff_stats.computed.load();
+            dirty |= PANE_FILES;
+        }
 
-        // Display commit messages
-        for (int i = starting_line; i < starting_line + lines_to_display && i < commit_message_count; i++) {
-            string truncated_message = truncate(commitList[i].message, maxX - 6);
-            mvwprintw(win, i - starting_line + 1, 2, "%s", truncated_message.c_str());
+        // Prefetch workers move the status bar counters on their own
+        if (prefetcher.prefetched.load() != shown_prefetched) {
+            shown_prefetched = prefetcher.prefetched.load();
+            dirty |= PANE_STATUS;
         }
 
-        // Highlight selected commit
-        if (window_flag == 0){
-          mvwchgat(win, cursor_position, 1, maxX - 4, A_REVERSE, 2, NULL);
+        auto frame_start = chrono::steady_clock::now();
+
+        // Status bar shows load progress until the walk finishes
+        if (dirty & PANE_STATUS) {
+            werase(status_bar);
+            wattron(status_bar, COLOR_PAIR(2));
+            if (!repo_error.empty()) {
+                mvwprintw(status_bar, 0, 0, " Error: %s", repo_error.c_str());
+            } else if (search.active) {
+                mvwprintw(status_bar, 0, 0, search.pickaxe ? " Pickaxe: %s" : " /%s", search.query.c_str());
+                if (!search.query.empty() && !search.pickaxe)
+                    wprintw(status_bar, "   [%zu matches]", search.matches.size());
+            } else if (pickaxe_view) {
+                mvwprintw(status_bar, 0, 0, " [Esc]%s | Pickaxe \"%s\": %d commits, scanned %zu/%zu",
+                          pickaxe->workers.empty() ? "Back" : "Stop", pickaxe->needle.c_str(), commit_message_count,
+                          pickaxe->scanned.load(), pickaxe->oids.size());
+            } else if (worktree_view) {
+                mvwprintw(status_bar, 0, 0, " [w]History [^/j]Up [v/k]Down [q]Quit | Working tree%s",
+                          worktree_scanning ? ": scanning..." : worktree_watching ? ", watched" : "");
+            } else if (loading && !path_filter.empty()) {
+                mvwprintw(status_bar, 0, 0, " [^/j]Up [v/k]Down [q]Quit | %d commits touch %s, %zu walked...",
+                          commit_message_count, path_filter.c_str(), loader.walked.load());
+            } else if (loading) {
+                mvwprintw(status_bar, 0, 0, " [^/j]Up [v/k]Down [q]Quit | loaded %d commits...", commit_message_count);
+            } else {
+                mvwprintw(status_bar, 0, 0, " [^/j]Up [v/k]Down [q]Quit | Total Commits: %d | File cache: %zu hits, %zu misses, %zu prefetched",
+                          commit_message_count, file_cache.hits.load(), file_cache.misses.load(), prefetcher.prefetched.load());
+            }
+            if (!search.active && !search.matches.empty())
+                wprintw(status_bar, " | /%s: %zu matches [n/N]", search.query.c_str(), search.matches.size());
+            wattroff(status_bar, COLOR_PAIR(2));
+            wnoutrefresh(status_bar);
         }
 
-        box(win, 0, 0);
-        wattron(win, COLOR_PAIR(1));
-        mvwprintw(win, 0, 2, "[ Commit History ]");
-        wattroff(win, COLOR_PAIR(1));
-        wrefresh(win);
+        // Refresh commit history window
+        if (dirty & PANE_HISTORY) {
+            werase(win);
+            box(win, 0, 0);
+            wattron(win, COLOR_PAIR(1));
+            mvwprintw(win, 0, 2, "%s", history_title.c_str());
+            wattroff(win, COLOR_PAIR(1));
+
+            // Display commit messages, after the lane graph when the pane
+            // shows the whole history (filtered views skip commits)
+            int end_line = min(starting_line + lines_to_display, commit_message_count);
+            if (show_graph) lane_graph_rows(lane_graph, commitList, starting_line, end_line, graph_rows);
+            for (int i = starting_line; i < end_line; i++) {
+                int x = 2;
+                if (show_graph) {
+                    const string& glyphs = graph_rows[i - starting_line];
+                    draw_graph_row(win, i - starting_line + 1, x, glyphs);
+                    x += min(glyphs.size(), (size_t)2 * GRAPH_MAX_LANES);
+                }
+                const git_oid& row_oid = commitList.oids[row_commit(view_rows, i)];
+                const string* label = lookup_decoration(decorations, row_oid);
+                if (label && x + (int)label->size() + 3 < maxX - 4) {
+                    wattron(win, COLOR_PAIR(1) | A_BOLD);
+                    mvwprintw(win, i - starting_line + 1, x, "(%s)", label->c_str());
+                    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+                    x += label->size() + 3;
+                }
+                string truncated_message = truncate(string(commit_subject(commitList, row_commit(view_rows, i))), max(maxX - 4 - x, 0));
+                bool match = binary_search(search.matches.begin(), search.matches.end(), i);
+                if (match) wattron(win, COLOR_PAIR(3));   // Search hits in yellow
+                mvwprintw(win, i - starting_line + 1, x, "%s", truncated_message.c_str());
+                if (match) wattroff(win, COLOR_PAIR(3));
+            }
+
+            // Placeholder below the loaded tail while the revwalk (or the
+            // pickaxe filling this view) is still running
+            bool filling = pickaxe_view ? !pickaxe->workers.empty() : loading;
+            if (filling && commit_message_count - starting_line < lines_to_display) {
+                wattron(win, A_DIM);
+                mvwprintw(win, commit_message_count - starting_line + 1, 2,
+                          pickaxe_view ? "searching..." : "loading more commits...");
+                wattroff(win, A_DIM);
+            }
+
+            // Highlight selected commit
+            if (window_flag == 0){
+              mvwchgat(win, cursor_position, 1, maxX - 4, A_REVERSE, 2, NULL);
+            }
+
+            box(win, 0, 0);
+            wattron(win, COLOR_PAIR(1));
+            mvwprintw(win, 0, 2, "%s", history_title.c_str());
+            wattroff(win, COLOR_PAIR(1));
+            wnoutrefresh(win);
+        }
 
         // Refresh commit info window
-        werase(commit_info_window);
-        box(commit_info_window, 0, 0);
-        wattron(commit_info_window, COLOR_PAIR(1));
-        mvwprintw(commit_info_window, 0, 2, "[ Commit Details ]");
-        wattroff(commit_info_window, COLOR_PAIR(1));
-
-        // Display detailed commit information
-        const CommitInfo& selected_commit = commitList[commit_info_window_count];
-        
-        wattron(commit_info_window, COLOR_PAIR(3));
-        mvwprintw(commit_info_window, 2, 2, "Commit ID: ");
-        wattroff(commit_info_window, COLOR_PAIR(3));
-        mvwprintw(commit_info_window, 2, 13, "%s", selected_commit.commit_id.c_str());
-
-        wattron(commit_info_window, COLOR_PAIR(2));
-        mvwprintw(commit_info_window, 3, 2, "Author:   ");
-        wattroff(commit_info_window, COLOR_PAIR(2));
-        mvwprintw(commit_info_window, 3, 13, "%s <%s>", 
-                 selected_commit.author.c_str(), 
-                 selected_commit.email.c_str());
-
-        wattron(commit_info_window, COLOR_PAIR(2));
-        mvwprintw(commit_info_window, 4, 2, "Date:     ");
-        wattroff(commit_info_window, COLOR_PAIR(2));
-        mvwprintw(commit_info_window, 4, 13, "%s", 
-                 format_time(selected_commit.commit_time).c_str());
-
-        // Draw separator
-        draw_horizontal_line(commit_info_window, 5, 1, maxX - 4);
-
-        wattron(commit_info_window, COLOR_PAIR(2));
-        mvwprintw(commit_info_window, 6, 2, "Message:");
-        wattroff(commit_info_window, COLOR_PAIR(2));
-        
-        // Handle multi-line commit messages
-        string msg = selected_commit.message;
-        size_t pos = 0;
-        int line = 7;
-        string delimiter = "\n";
-        while ((pos = msg.find(delimiter)) != string::npos) {
-            string token = msg.substr(0, pos);
-            mvwprintw(commit_info_window, line++, 4, "%s", token.c_str());
-            msg.erase(0, pos + delimiter.length());
-        }
-        if (!msg.empty()) {
-            mvwprintw(commit_info_window, line, 4, "%s", msg.c_str());
-        }
-
-        // Refresh windows
-        wrefresh(commit_info_window);
-        wrefresh(win);
+        if (dirty & PANE_DETAILS) {
+            werase(commit_info_window);
+            box(commit_info_window, 0, 0);
+            wattron(commit_info_window, COLOR_PAIR(1));
+            mvwprintw(commit_info_window, 0, 2, "[ Commit Details ]");
+            wattroff(commit_info_window, COLOR_PAIR(1));
+
+            if (commit_message_count > 0) {
+                // Display detailed commit information
+                const git_oid& selected_oid = commitList.oids[selected_commit];
         
+                wattron(commit_info_window, COLOR_PAIR(3));
+                mvwprintw(commit_info_window, 2, 2, "Commit ID: ");
+                wattroff(commit_info_window, COLOR_PAIR(3));
+                mvwprintw(commit_info_window, 2, 13, "%s", git_oid_tostr_s(&selected_oid));
+
+                wattron(commit_info_window, COLOR_PAIR(2));
+                mvwprintw(commit_info_window, 3, 2, "Author:   ");
+                wattroff(commit_info_window, COLOR_PAIR(2));
+                mvwprintw(commit_info_window, 3, 13, "%s <%s>", 
+                         commit_author(commitList, selected_commit).c_str(),
+                         commit_email(commitList, selected_commit).c_str());
+
+                wattron(commit_info_window, COLOR_PAIR(2));
+                mvwprintw(commit_info_window, 4, 2, "Date:     ");
+                wattroff(commit_info_window, COLOR_PAIR(2));
+                mvwprintw(commit_info_window, 4, 13, "%s", 
+                         format_time(commitList.times[selected_commit]).c_str());
+
+                // Draw separator
+                draw_horizontal_line(commit_info_window, 5, 1, maxX - 4);
+
+                wattron(commit_info_window, COLOR_PAIR(2));
+                mvwprintw(commit_info_window, 6, 2, "Message:");
+                wattroff(commit_info_window, COLOR_PAIR(2));
         
-                // code for files Changed
-        werase(files_changed);
-        box(files_changed, 0, 0);
-        wattron(files_changed, COLOR_PAIR(1));
-        mvwprintw(files_changed, 0, 2, "[ Files Changed ]");
-        wattroff(files_changed, COLOR_PAIR(1));
-
-        git_commit* current_commit = NULL;
-        git_commit* parent_commit = NULL;
-        git_tree* current_tree = NULL;
-        git_tree* parent_tree = NULL;
-        git_diff* diff = NULL;
-
-        // Get current commit
-        git_oid current_oid;
-        git_oid_fromstr(&current_oid, commitList[commit_info_window_count].commit_id.c_str());
-        error = git_commit_lookup(&current_commit, repo, &current_oid);
-
-        if (error == 0) {
-            // Get current commit tree
-            error = git_commit_tree(&current_tree, current_commit);
-            
-            // Get parent commit (if any)
-            if (git_commit_parentcount(current_commit) > 0) {
-                error = git_commit_parent(&parent_commit, current_commit, 0);
-                if (error == 0) {
-                    error = git_commit_tree(&parent_tree, parent_commit);
-                    
-                    // Compare trees
-                    if (error == 0) {
-                        error = git_diff_tree_to_tree(&diff, repo, parent_tree, current_tree, NULL);
-                        
-                        if (error == 0) {
-                            file_changed_list.clear();
-                            size_t num_deltas = git_diff_num_deltas(diff);
-                            
-                            for (size_t i = 0; i < num_deltas; ++i) {
-                                const git_diff_delta* delta = git_diff_get_delta(diff, i);
-                                string status;
-                                switch (delta->status) {
-                                    case GIT_DELTA_ADDED: status = "[A] "; break;
-                                    case GIT_DELTA_MODIFIED: status = "[M] "; break;
-                                    case GIT_DELTA_DELETED: status = "[D] "; break;
-                                    default: status = "[?] "; break;
-                                }
-                                file_changed_list.push_back(status + delta->new_file.path);
-                            }
-                           
-                            files_cursor_position = max(min(files_cursor_position, files_changed_lines_to_display), 1);
-                            files_starting_line = max(min(files_starting_line, (int)file_changed_list.size() - files_changed_lines_to_display), 0);
-
-                            int current_y_files_changed = 1;
-                            for (int i = files_starting_line; 
-                                 i < files_starting_line + files_changed_lines_to_display && i < file_changed_list.size(); 
-                                 i++) {
-                                mvwprintw(files_changed, current_y_files_changed++, 2, "%s", file_changed_list[i].c_str());
-                            }
-                        }
+                // The commit list only keeps subjects; load the full message on selection
+                if (selected_message_index != selected_commit) {
+                    git_commit* message_commit = NULL;
+                    if (git_commit_lookup(&message_commit, repo, &selected_oid) == 0) {
+                        selected_message = git_commit_message(message_commit);
+                        git_commit_free(message_commit);
+                    } else {
+                        selected_message = commit_subject(commitList, selected_commit);
                     }
+                    selected_message_index = selected_commit;
                 }
-            } else {
-                // For initial commit, show all files as added
-                error = git_diff_tree_to_tree(&diff, repo, NULL, current_tree, NULL);
-                if (error == 0) {
-                    file_changed_list.clear();
-                    size_t num_deltas = git_diff_num_deltas(diff);
-                    for (size_t i = 0; i < num_deltas; ++i) {
-                        const git_diff_delta* delta = git_diff_get_delta(diff, i);
-                        file_changed_list.push_back("[A] " + string(delta->new_file.path));
+
+                // Handle multi-line commit messages
+                string msg = selected_message;
+                size_t pos = 0;
+                int line = 7;
+                string delimiter = "\n";
+                while ((pos = msg.find(delimiter)) != string::npos) {
+                    string token = msg.substr(0, pos);
+                    mvwprintw(commit_info_window, line++, 4, "%s", token.c_str());
+                    msg.erase(0, pos + delimiter.length());
+                }
+                if (!msg.empty()) {
+                    mvwprintw(commit_info_window, line, 4, "%s", msg.c_str());
+                }
+            }
+
+            wnoutrefresh(commit_info_window);
+        }
+
+        // code for files Changed
+        if (dirty & PANE_FILES) {
+            string files_title = "[ Files Changed ]";
+            if (worktree_view) {
+                size_t total = changed_files ? changed_files->files.size() : 0;
+                files_title = "[ Working Tree: " + to_string(worktree_staged) + " staged, " +
+                              to_string(total - worktree_staged) + " unstaged" +
+                              (worktree_scanning ? ", scanning..." : "") + " ]";
+            }
+            werase(files_changed);
+
+            if (worktree_view && changed_files && changed_files->files.empty()) {
+                wattron(files_changed, A_DIM);
+                mvwprintw(files_changed, 1, 2, worktree_scanning ? "scanning..." : "nothing to commit, working tree clean");
+                wattroff(files_changed, A_DIM);
+            } else if (changed_files) {
+                const vector<FileDelta>& files = changed_files->files;
+                files_cursor_position = max(min(files_cursor_position, files_changed_lines_to_display), 1);
+                files_starting_line = max(min(files_starting_line, (int)files.size() - files_changed_lines_to_display), 0);
+                int files_end = min(files_starting_line + files_changed_lines_to_display, (int)files.size());
+
+                // Count from the top of the view down when the list or the view
+                // moved. Working-tree files are not blobs yet, so they go uncounted.
+                vector<const LineStats*> row_stats(files_end - files_starting_line);
+                if (worktree_view) {
+                    stats_complete = true;
+                } else {
+                    if (stats_list != changed_files) stats_complete = false;
+                    if (!stats_complete && (stats_list != changed_files || stats_start != files_starting_line)) {
+                        request_line_stats(diff_stats, changed_files, files_starting_line);
+                        stats_list = changed_files;
+                        stats_start = files_starting_line;
                     }
-                    
+                    lookup_line_stats(diff_stats, files, files_starting_line, files_end, row_stats);
+                    if (!stats_complete) stats_complete = line_stats_total(diff_stats, changed_files, stats_total);
+                }
+                if (stats_complete && !worktree_view) {
+                    files_title = "[ Files Changed: " + to_string(files.size()) + " files +" + to_string(stats_total.added) +
+                                  " -" + to_string(stats_total.deleted) + " ]";
+                }
 
-                    int current_y_files_changed = 1;
-                    for (int i=0; i<file_changed_list.size() && i<=files_changed_lines_to_display; i++) {
-                        mvwprintw(files_changed, current_y_files_changed++, 2, "%s", file_changed_list[i].c_str());
+                int width = getmaxx(files_changed);
+                int current_y_files_changed = 1;
+                for (int i = files_starting_line; i < files_end; i++) {
+                    const LineStats* file_stats = row_stats[i - files_starting_line];
+                    string counts = file_stats ? format_line_stats(*file_stats) : "";
+                    string entry = delta_status_label(files[i]) + delta_display_path(files[i]);
+                    int room = width - 4 - (counts.empty() ? 0 : counts.size() + 1);
+                    if ((int)entry.size() > room) entry = entry.substr(0, max(room, 0));
+                    mvwprintw(files_changed, current_y_files_changed, 2, "%s", entry.c_str());
+                    if (worktree_view) {
+                        // Staged changes in green, unstaged ones in red, as git status does
+                        int label = min(entry.find(' '), entry.size());
+                        mvwchgat(files_changed, current_y_files_changed, 2, label, 0,
+                                 i < (int)worktree_staged ? 1 : 5, NULL);
+                    }
+                    if (file_stats && !file_stats->binary) {
+                        size_t split = counts.find(' ');
+                        int x = width - 2 - counts.size();
+                        wattron(files_changed, COLOR_PAIR(1));
+                        mvwprintw(files_changed, current_y_files_changed, x, "%s", counts.substr(0, split).c_str());
+                        wattroff(files_changed, COLOR_PAIR(1));
+                        wattron(files_changed, COLOR_PAIR(5));
+                        mvwprintw(files_changed, current_y_files_changed, x + split, "%s", counts.substr(split).c_str());
+                        wattroff(files_changed, COLOR_PAIR(5));
+                    } else if (file_stats) {
+                        wattron(files_changed, A_DIM);
+                        mvwprintw(files_changed, current_y_files_changed, width - 2 - counts.size(), "%s", counts.c_str());
+                        wattroff(files_changed, A_DIM);
                     }
+                    current_y_files_changed++;
                 }
+            } else if (files_pending) {
+                wattron(files_changed, A_DIM);
+                mvwprintw(files_changed, 1, 2, "computing...");
+                wattroff(files_changed, A_DIM);
             }
-        }
 
-        // Cleanup
-        if (diff) git_diff_free(diff);
-        if (current_tree) git_tree_free(current_tree);
-        if (parent_tree) git_tree_free(parent_tree);
-        if (current_commit) git_commit_free(current_commit);
-        if (parent_commit) git_commit_free(parent_commit);
-         
-        if (window_flag == 1) {
-            mvwchgat(files_changed, files_cursor_position, 1, maxX/2 - 3, A_REVERSE, 2, NULL);
-        }       
+            if (window_flag == 1) {
+                mvwchgat(files_changed, files_cursor_position, 1, maxX/2 - 3, A_REVERSE, 2, NULL);
+            }       
      
-        box(files_changed, 0, 0);
-        wattron(files_changed, COLOR_PAIR(1));
-        mvwprintw(files_changed, 0, 2, "[ Files Changed ]");
-        wattroff(files_changed, COLOR_PAIR(1));
-        wrefresh(files_changed);
-
+            box(files_changed, 0, 0);
+            wattron(files_changed, COLOR_PAIR(1));
+            mvwprintw(files_changed, 0, 2, "%s", files_title.c_str());
+            wattroff(files_changed, COLOR_PAIR(1));
+            wnoutrefresh(files_changed);
+        }
 
+        if (window_flag >= 1 && changed_files && !changed_files->files.empty()) {
+            int selected_index = min(files_starting_line + files_cursor_position - 1,
+                                     (int)changed_files->files.size() - 1);
+            string file_path = changed_files->files[selected_index].new_path;
+            int diff_source = !worktree_view ? selected_commit
+                              : selected_index < (int)worktree_staged ? WORKTREE_STAGED : WORKTREE_UNSTAGED;
 
-        if (window_flag == 1 && !file_changed_list.empty()) {
-            string selected_file = file_changed_list[files_starting_line + files_cursor_position - 1];
-            string file_path = selected_file.substr(4);  // Remove the status prefix [A]/[M]/[D]
-            
             // Only update diff if we've selected a different file
-            if (file_path != current_diff_file) {
+            if (file_path != current_diff_file || diff_commit_index != diff_source) {
                 current_diff_file = file_path;
-                diff_content.lines.clear();
+                diff_commit_index = diff_source;
+                worktree_rediff = false;
+                diff_content.text = NULL;
+                diff_content.limit = diff_limit;
                 diff_content.starting_line = 0;
                 diff_content.cursor_position = 1;
-                
-                git_commit* current_commit = NULL;
-                git_commit* parent_commit = NULL;
-                git_tree* current_tree = NULL;
-                git_tree* parent_tree = NULL;
-                git_diff* diff = NULL;
-                
-                // Get current commit
-                git_oid current_oid;
-                git_oid_fromstr(&current_oid, commitList[commit_info_window_count].commit_id.c_str());
-                git_commit_lookup(&current_commit, repo, &current_oid);
-                
-                if (current_commit) {
-                    git_commit_tree(&current_tree, current_commit);
-                    
-                    // Set up diff options to filter for the selected file
-                    git_diff_options diff_opts = GIT_DIFF_OPTIONS_INIT;
-                    git_strarray pathspec = {0};
-                    const char* paths[] = { file_path.c_str() };
-                    pathspec.strings = const_cast<char**>(paths);
-                    pathspec.count = 1;
-                    diff_opts.pathspec = pathspec;
-                    diff_opts.context_lines = 3;  // Number of context lines around changes
-                    
-                    if (git_commit_parentcount(current_commit) > 0) {
-                        git_commit_parent(&parent_commit, current_commit, 0);
-                        git_commit_tree(&parent_tree, parent_commit);
-                        
-                        // Generate diff for specific file
-                        git_diff_tree_to_tree(&diff, repo, parent_tree, current_tree, &diff_opts);
-                    } else {
-                        // For initial commit, compare with empty tree
-                        git_diff_tree_to_tree(&diff, repo, NULL, current_tree, &diff_opts);
-                    }
-                    
-                    if (diff) {
-                        // Add file header
-                        diff_content.lines.push_back("diff --git a/" + file_path + " b/" + file_path);
-                        
-                        // Collect diff content
-                        git_diff_print(diff, GIT_DIFF_FORMAT_PATCH, diff_line_callback, &diff_content.lines);
-                    }
+                diff_pending = false;
+                blame_view.file = NULL;
+                dirty |= PANE_DIFF;
+
+                // A prefetch worker may already have produced this patch
+                const vector<shared_ptr<const DiffText>>& patches = changed_files->patches;
+                if (selected_index < (int)patches.size() && patches[selected_index]) {
+                    diff_content.text = patches[selected_index];
+                    diff_content.old_id = changed_files->files[selected_index].old_id;
+                    diff_content.new_id = changed_files->files[selected_index].new_id;
                 }
-                
-                // Cleanup
-                if (diff) git_diff_free(diff);
-                if (current_tree) git_tree_free(current_tree);
-                if (parent_tree) git_tree_free(parent_tree);
-                if (current_commit) git_commit_free(current_commit);
-                if (parent_commit) git_commit_free(parent_commit);
+            }
+
+            // Have the worker cut this file's patch out of the commit's diff,
+            // again with a larger limit after 'X' on a truncated diff
+            if ((!diff_pending || worktree_rediff) &&
+                (!diff_content.text || worktree_rediff ||
+                 (diff_content.text->truncated && diff_content.text->limit < diff_content.limit))) {
+                post_diff_job(diff_jobs, worktree_view ? git_oid() : commitList.oids[selected_commit], selected_index,
+                              diff_content.limit, &changed_files->files[selected_index],
+                              worktree_view ? diff_source : 0);
+                worktree_rediff = false;
+                diff_pending = true;
+                dirty |= PANE_DIFF;
+            }
+        }
+
+        // Keep the lines around the blame view blamed, and redraw as ranges land
+        blame_pending = false;
+        if (blame_view.file) {
+            blame_pending = request_blame(blame_jobs, blame_view.file,
+                                          max(blame_view.starting_line - BLAME_MARGIN_LINES, 0),
+                                          blame_view.starting_line + diff_content.lines_to_display + BLAME_MARGIN_LINES);
+            if (blame_jobs.finished != shown_blames) {
+                shown_blames = blame_jobs.finished;
+                dirty |= PANE_DIFF;
             }
         }
 
-        werase(diff_window);
-        box(diff_window, 0, 0);
-        wattron(diff_window, COLOR_PAIR(1));
-        mvwprintw(diff_window, 0, 2, "[ Git Diff: %s ]", current_diff_file.c_str());
-        wattroff(diff_window, COLOR_PAIR(1));
+        if ((dirty & PANE_DIFF) && blame_view.file) {
+            draw_blame_view(diff_window, blame_jobs, blame_view, diff_content.lines_to_display, window_flag == 2);
+        } else if (dirty & PANE_DIFF) {
+            werase(diff_window);
+            box(diff_window, 0, 0);
+            wattron(diff_window, COLOR_PAIR(1));
+            mvwprintw(diff_window, 0, 2, "[ Git Diff: %s%s ]", current_diff_file.c_str(),
+                      diff_content.text && diff_content.text->binary ? " (binary)" : "");
+            wattroff(diff_window, COLOR_PAIR(1));
 
-        // Add padding at the top
-        int content_start_y = 2;  // Start content with 1 line padding after title
-        int left_padding = 3;     // Increase left padding from 2 to 3
+            // Add padding at the top
+            int content_start_y = 2;  // Start content with 1 line padding after title
+            int left_padding = 3;     // Increase left padding from 2 to 3
         
-        // Calculate available lines considering padding
-        diff_content.lines_to_display = (2 * maxY/3 - 6);  // Reduce by 1 to prevent overlap with bottom border
-
-        // Display diff content with scrolling and color coding
-        for (int i = diff_content.starting_line; 
-             i < diff_content.starting_line + diff_content.lines_to_display && i < diff_content.lines.size(); 
-             i++) {
-            if (!diff_content.lines[i].empty()) {
-                char first_char = diff_content.lines[i][0];
-                switch (first_char) {
-                    case '+':
-                        wattron(diff_window, COLOR_PAIR(1));  // Green for additions
-                        break;
-                    case '-':
-                        wattron(diff_window, COLOR_PAIR(2));  // Red for deletions
-                        break;
-                    case 'F':
-                    case 'H':
-                        wattron(diff_window, COLOR_PAIR(3));  // Yellow for headers
-                        break;
+            // Calculate available lines considering padding
+            diff_content.lines_to_display = (2 * maxY/3 - 6);  // Reduce by 1 to prevent overlap with bottom border
+
+            // Display diff content with scrolling and color coding; only the
+            // visible part of each visible line is written to the window.
+            // Side by side, old lines take the left half and new lines the
+            // right, with the pairs of a change block on one row.
+            int diff_rows = diff_pane_rows(side_by_side_view ? &side_by_side : NULL, diff_content.text);
+            int first_row = diff_content.starting_line;
+            int last_row = min(first_row + diff_content.lines_to_display, diff_rows);
+            int right_edge = maxX/2 - 3;    // The border
+            int middle = (left_padding + right_edge) / 2;
+            // The new side starts a whole number of tab stops from the old
+            // one, so tabs indent both sides alike
+            int right_start = left_padding + (middle + 2 - left_padding + TABSIZE - 1) / TABSIZE * TABSIZE;
+
+            // Tokens and changed words of the lines on the visible rows
+            int first_line = first_row, end_line = last_row;
+            if (side_by_side_view && first_row < last_row) {
+                int left, right;
+                side_by_side_lines(side_by_side, first_row, left, right);
+                first_line = left < 0 ? right : right < 0 ? left : min(left, right);
+                side_by_side_lines(side_by_side, last_row - 1, left, right);
+                end_line = max(left, right) + 1;
+            }
+            highlight_diff_rows(diff_highlight, highlight_cache, diff_content, current_diff_file,
+                                first_line, end_line, highlight_rows);
+            refine_diff_lines(diff_words, diff_content.text, first_line, end_line);
+            auto draw_line = [&](int y, int x, int right, int line) {
+                auto words = diff_words.lines.find(line);
+                draw_diff_line(diff_window, y, x, right, *diff_content.text, line, highlight_rows[line - first_line],
+                               words == diff_words.lines.end() ? NULL : &words->second);
+            };
+
+            for (int i = first_row; i < last_row; i++) {
+                const DiffText& text = *diff_content.text;
+
+                // Calculate y position with padding
+                int current_y = content_start_y + (i - first_row);
+
+                // Clear the entire line first to prevent character overlap
+                wmove(diff_window, current_y, 1);
+                wclrtoeol(diff_window);
+
+                int left = i, right = i;
+                if (side_by_side_view) side_by_side_lines(side_by_side, i, left, right);
+                int line = left >= 0 ? left : right;
+                if (line == (int)diff_line_count(text)) {
+                    wattron(diff_window, COLOR_PAIR(3));
+                    if (diff_pending) {
+                        mvwprintw(diff_window, current_y, left_padding, "-- computing... --");
+                    } else {
+                        mvwprintw(diff_window, current_y, left_padding,
+                                  "-- diff truncated at %zu MB, press X to load more --", text.limit >> 20);
+                    }
+                    wattroff(diff_window, COLOR_PAIR(3));
+                    continue;
+                }
+
+                // Headers span both sides
+                if (!side_by_side_view || (left == right && text.origins[line] != ' ')) {
+                    draw_line(current_y, left_padding, right_edge, line);
+                    continue;
                 }
+                if (left >= 0) draw_line(current_y, left_padding, middle - 1, left);
+                if (right >= 0) draw_line(current_y, right_start, right_edge, right);
+                mvwaddch(diff_window, current_y, middle, ACS_VLINE);
+            }
+
+            if (diff_pending && !diff_content.text) {
+                wattron(diff_window, A_DIM);
+                mvwprintw(diff_window, content_start_y, left_padding, "computing...");
+                wattroff(diff_window, A_DIM);
+            }
+
+            if (window_flag == 2 && diff_rows > 0) {
+                mvwchgat(diff_window, content_start_y + diff_content.cursor_position - 1,
+                        1, maxX/2 - 2, A_REVERSE, 2, NULL);
             }
-            
-            // Calculate y position with padding
-            int current_y = content_start_y + (i - diff_content.starting_line);
-            
-            // Clear the entire line first to prevent character overlap
-            wmove(diff_window, current_y, 1);
-            wclrtoeol(diff_window);
-            
-            // Print the line with left padding
-            mvwprintw(diff_window, current_y, left_padding, "%s", 
-                     diff_content.lines[i].c_str());
-            
-            wattroff(diff_window, COLOR_PAIR(1));
-            wattroff(diff_window, COLOR_PAIR(2));
-            wattroff(diff_window, COLOR_PAIR(3));
 
-        // Display diff content
-      }
+            // Redraw box to ensure clean borders
+            box(diff_window, 0, 0);
+            wattron(diff_window, COLOR_PAIR(1));
+            mvwprintw(diff_window, 0, 2, "[ Git Diff: %s%s ]", current_diff_file.c_str(),
+                      diff_content.text && diff_content.text->binary ? " (binary)" : "");
+            wattroff(diff_window, COLOR_PAIR(1));
 
+            wnoutrefresh(diff_window);
+        }
 
-        if (window_flag == 2 && !diff_content.lines.empty()) {
-            mvwchgat(diff_window, content_start_y + diff_content.cursor_position - 1, 
-                    1, maxX/2 - 2, A_REVERSE, 2, NULL);
+        // The overlay goes on top of whatever was drawn, and refreshes
+        // every frame since the timings move on their own
+        if (show_timings) {
+            draw_timings_overlay(timings_overlay, file_cache, prefetcher.prefetched.load(), diff_stats,
+                                 commitList.oids.size());
         }
 
-        // Redraw box to ensure clean borders
-        box(diff_window, 0, 0);
-        wattron(diff_window, COLOR_PAIR(1));
-        mvwprintw(diff_window, 0, 2, "[ Git Diff: %s ]", current_diff_file.c_str());
-        wattroff(diff_window, COLOR_PAIR(1));
+        // The analytics overlay only changes while its analysis runs; once
+        // drawn, the rankings are just put back over panes drawn beneath it
+        if (show_analytics && analytics) {
+            if (analytics_drawn != analytics.get()) {
+                if (analytics->done) analytics_drawn = analytics.get();
+                draw_analytics_overlay(analytics_overlay, *analytics);
+            } else if (dirty) {
+                touchwin(analytics_overlay);
+                wnoutrefresh(analytics_overlay);
+            }
+        }
 
-        wrefresh(diff_window);
+        // Push every pane drawn this frame to the terminal in one write
+        {
+            ScopedTimer timer(TIMER_DOUPDATE);
+            doupdate();
+        }
+        record_timing(TIMER_FRAME, frame_start, chrono::steady_clock::now());
+        dirty = 0;
+        if (bench.enabled) bench_frame_drawn(bench, frame_start, !commitList.oids.empty(), loading);
 
+        // Handle keyboard input; poll while git work is outstanding so its
+        // result is drawn as soon as it lands
+        bool searching = pickaxe && !pickaxe->workers.empty();
+        bool analyzing = show_analytics && analytics && analytics_drawn != analytics.get();
+        bool counting = changed_files && !stats_complete;
+        int wait_ms = files_pending || diff_pending || blame_pending || counting ? DIFF_JOB_POLL_MS
+                      : loading || searching || refreshing || worktree_scanning || analyzing ? LOADING_POLL_MS
+                      : refs_watch.changed ? REFRESH_SETTLE_MS
+                      : refs_watch.fd >= 0 || worktree_started ? WATCH_POLL_MS : -1;
+        if (show_timings && (wait_ms < 0 || wait_ms > OVERLAY_REFRESH_MS)) wait_ms = OVERLAY_REFRESH_MS;
+        timeout(wait_ms);
+        int ch;
+        if (bench.enabled) {
+            // Background counting and prefetching don't hold the next key back
+            ch = bench_read_key(bench, !files_pending && !diff_pending && !blame_pending && !loading && !searching &&
+                                       !(worktree_view && worktree_scanning));
+            if (bench.done) break;
+        } else {
+            ch = getch();
+        }
+        if (ch == ERR) {
+            continue;  // Poll timeout: redraw with new commits or a finished diff
+        }
 
+        // Keys already queued behind this one (key repeat) are applied
+        // together and drawn as a single frame
+        bool quit = false;
+        timeout(0);
+        for (; ch != ERR; ch = bench.enabled ? ERR : getch()) {
+            reselect = false;   // The user has moved on from the commit being reloaded
+            // While the search prompt is open, keys edit the query
+            if (search.active) {
+                if (ch == 27) {
+                    // Esc: drop the search and go back to where it started
+                    search.active = false;
+                    search.query.clear();
+                    search.matches.clear();
+                    search_changed = false;
+                    select_commit(search.origin, commit_message_count, lines_to_display,
+                                  commit_info_window_count, starting_line, cursor_position);
+                } else if ((ch == '\n' || ch == KEY_ENTER) && search.pickaxe) {
+                    // Replace the history pane with the commits the workers find
+                    search.active = false;
+                    if (!search.query.empty() && !commitList.oids.empty()) {
+                        if (pickaxe) stop_pickaxe(*pickaxe);
+                        pickaxe.reset(new Pickaxe());
+                        start_pickaxe(*pickaxe, repo_path, search.query, commitList);
+                        search.query.clear();
+                        pickaxe_rows.clear();
+                        pickaxe_view = true;
+                        commit_info_window_count = 0;
+                        starting_line = 0;
+                        cursor_position = 1;
+                        window_flag = 0;
+                    }
+                    dirty |= PANE_ALL;
+                } else if (ch == '\n' || ch == KEY_ENTER) {
+                    search.active = false;
+                } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+                    if (!search.query.empty()) search.query.pop_back();
+                    search_changed = !search.pickaxe;
+                } else if (ch >= 32 && ch < 127) {
+                    search.query.push_back(ch);
+                    search_changed = !search.pickaxe;
+                }
+                dirty |= PANE_HISTORY | PANE_DETAILS | PANE_STATUS;
+                continue;
+            }
 
-       // Handle keyboard input
-        int ch = getch();
-        
-                
-        if (ch == '\t') {
-            window_flag++;
-            if (window_flag > 2) window_flag = 0;
+            if (ch == '\t') {
+                window_flag++;
+                if (window_flag > 2) window_flag = 0;
             
-            // Reset cursor positions when switching windows
-            if (window_flag == 1) {
+                // Reset cursor positions when switching windows
+                if (window_flag == 1) {
+                    files_starting_line = 0;
+                    files_cursor_position = 1;
+                } else if (window_flag == 2) {
+                    diff_content.starting_line = 0;
+                    diff_content.cursor_position = 1;
+                }
+                dirty |= PANE_HISTORY | PANE_FILES | PANE_DIFF;  // The highlight moves
+            }
+
+            if (ch == 'q') {
+                quit = true;
+                break;
+            } else if (ch == 'P') {
+                show_timings = !show_timings;
+                if (!show_timings) dirty |= PANE_ALL;   // Uncover the panes beneath
+            } else if (ch == 'A') {
+                // Who touched what over the loaded history, analyzed again
+                // once the history changed (and a run in progress is done)
+                show_analytics = !show_analytics;
+                bool stale = analytics && analytics->done &&
+                             (analytics->oids.size() != commitList.oids.size() ||
+                              (!commitList.oids.empty() && !git_oid_equal(&analytics->oids[0], &commitList.oids[0])));
+                if (show_analytics && (!analytics || stale)) {
+                    if (analytics) stop_analytics(*analytics);
+                    analytics.reset(new Analytics());
+                    start_analytics(*analytics, repo_path, path_filter, commitList, churn_cache);
+                }
+                analytics_drawn = NULL;
+                if (!show_analytics) dirty |= PANE_ALL;
+            } else if (ch == 'b' && window_flag == 2 && !blame_view.file && diff_commit_index >= 0 &&
+                       !current_diff_file.empty()) {
+                // Blame the file shown in the diff pane, as of the commit it is shown for
+                blame_view.file = open_blame(blame_jobs, commitList.oids[diff_commit_index], current_diff_file);
+                blame_view.starting_line = 0;
+                blame_view.cursor_position = 1;
+                blame_view.note.clear();
+                dirty |= PANE_DIFF;
+            } else if ((ch == 'b' || ch == 27) && window_flag == 2 && blame_view.file) {
+                blame_view.file = NULL;
+                dirty |= PANE_DIFF;
+            } else if ((ch == '\n' || ch == KEY_ENTER) && window_flag == 2 && blame_view.file) {
+                // Jump to the commit that last changed the line under the cursor
+                int line = blame_view.starting_line + blame_view.cursor_position - 1;
+                git_oid target;
+                bool blamed = false;
+                {
+                    lock_guard<mutex> guard(blame_jobs.lock);
+                    const BlameFile& file = *blame_view.file;
+                    if (line < (int)file.line_hunks.size() && file.line_hunks[line] >= 0) {
+                        target = file.hunks[file.line_hunks[line]].commit;
+                        blamed = true;
+                    }
+                }
+                int row = blamed ? find_commit_row(commitList, view_rows, target) : -1;
+                if (row >= 0) {
+                    scroll_direction = row > commit_info_window_count ? 1 : -1;
+                    select_commit(row, commit_message_count, lines_to_display,
+                                  commit_info_window_count, starting_line, cursor_position);
+                    blame_view.file = NULL;
+                    window_flag = 0;
+                    dirty |= PANE_ALL;
+                } else if (blamed) {
+                    blame_view.note = loading ? "commit not loaded yet" : "commit not in this history";
+                    dirty |= PANE_DIFF;
+                }
+            } else if (ch == 27 && pickaxe_view) {
+                // Esc stops a running pickaxe, then leaves its view for the
+                // full history with the same commit selected
+                if (!pickaxe->workers.empty()) {
+                    pickaxe->stop = true;   // Joined once the last matches are drained
+                } else {
+                    pickaxe_view = false;
+                    search.matches.clear();
+                    int selected = pickaxe_rows.empty() ? 0 : pickaxe_rows[commit_info_window_count];
+                    select_commit(selected, commitList.oids.size(), lines_to_display,
+                                  commit_info_window_count, starting_line, cursor_position);
+                }
+                dirty |= PANE_ALL;
+            } else if (ch == '/' || ch == 'S') {
+                search.active = true;
+                search.pickaxe = ch == 'S';
+                search.query.clear();
+                search.matches.clear();
+                search.origin = commit_info_window_count;
+                window_flag = 0;
+                dirty |= PANE_ALL;
+            } else if ((ch == 'n' || ch == 'N') && !search.matches.empty()) {
+                // Step through the matches of the last search
+                scroll_direction = ch == 'n' ? 1 : -1;
+                int match = next_match(search, commit_info_window_count, scroll_direction);
+                select_commit(match, commit_message_count, lines_to_display,
+                              commit_info_window_count, starting_line, cursor_position);
+                dirty |= PANE_HISTORY | PANE_DETAILS;
+            } else if (ch == 'w') {
+                // Toggle between the selected commit's changes and the working tree's
+                worktree_view = !worktree_view;
                 files_starting_line = 0;
                 files_cursor_position = 1;
-            } else if (window_flag == 2) {
-                diff_content.starting_line = 0;
-                diff_content.cursor_position = 1;
-            }
-        }
-        
-        if (ch == 'q') {
-            break;
-        } else if (ch == KEY_DOWN || ch == 'k') {
-            if (window_flag == 0) {
-                if (commit_info_window_count < commit_message_count - 1) {
-                    commit_info_window_count++;
-                    if (cursor_position < lines_to_display) {
-                        cursor_position++;
-                    } else if (starting_line + lines_to_display < commit_message_count) {
-                        starting_line++;
+                current_diff_file = "";
+                diff_content.text = NULL;
+                blame_view.file = NULL;
+                if (diff_pending) cancel_diff_job(diff_jobs);
+                diff_pending = false;
+                files_pending = false;
+                if (worktree_view) {
+                    if (!worktree_started) {
+                        start_worktree_status(worktree, repo_path);
+                        worktree_started = true;
+                        worktree_scanning = true;
+                    } else {
+                        lock_guard<mutex> guard(worktree.lock);
+                        if (!worktree.watching) worktree.full_rescan = true;   // Nothing kept it current
                     }
+                    changed_files = worktree_files;
+                    worktree_staged = worktree_files_staged;
+                    window_flag = 1;
+                } else {
+                    files_commit_index = -1;   // Back to the selected commit's files
+                    if (window_flag == 1 || window_flag == 2) window_flag = 0;
                 }
-            } else if (window_flag == 1) {
-                if (files_cursor_position < files_changed_lines_to_display && 
-                    files_starting_line + files_cursor_position < file_changed_list.size()) {
-                    files_cursor_position++;
-                } else if (files_starting_line + files_changed_lines_to_display < file_changed_list.size()) {
-                    files_starting_line++;
-                }
-            }
-            else if (window_flag == 2 && !diff_content.lines.empty()) {
-                if (diff_content.cursor_position < diff_content.lines_to_display && 
-                    diff_content.starting_line + diff_content.cursor_position < diff_content.lines.size()) {
-                    diff_content.cursor_position++;
-                } else if (diff_content.starting_line + diff_content.lines_to_display < diff_content.lines.size()) {
-                    diff_content.starting_line++;
-                }
-            }
-        } else if (ch == KEY_UP || ch == 'j') {
-            if (window_flag == 0) {
-                if (commit_info_window_count > 0) {
-                    commit_info_window_count--;
-                    if (cursor_position > 1) {
-                        cursor_position--;
-                    } else if (starting_line > 0) {
-                        starting_line--;
+                dirty |= PANE_ALL;
+            } else if (ch == 's') {
+                // Toggle the side-by-side layout, keeping the same line on top
+                if (diff_content.text) {
+                    int top = diff_content.starting_line;
+                    if (side_by_side_view) {
+                        int left, right;
+                        build_side_by_side(side_by_side, diff_content.text);
+                        side_by_side_lines(side_by_side, top, left, right);
+                        top = left >= 0 ? left : right;
+                    }
+                    side_by_side_view = !side_by_side_view;
+                    if (side_by_side_view) {
+                        build_side_by_side(side_by_side, diff_content.text);
+                        top = side_by_side_row(side_by_side, top);
+                    }
+                    diff_content.starting_line = max(min(top, diff_pane_rows(side_by_side_view ? &side_by_side : NULL,
+                                                                              diff_content.text) -
+                                                              diff_content.lines_to_display), 0);
+                } else {
+                    side_by_side_view = !side_by_side_view;
+                }
+                dirty |= PANE_DIFF;
+            } else if (ch == 'X') {
+                // Double the cap on a truncated diff; it is rebuilt on the next frame
+                if (diff_content.text && diff_content.text->truncated)
+                    diff_content.limit = min(diff_content.limit * 2, (size_t)UINT32_MAX);
+            } else if (ch == KEY_DOWN || ch == 'k') {
+                dirty |= window_flag == 0 ? PANE_HISTORY | PANE_DETAILS : window_flag == 1 ? PANE_FILES : PANE_DIFF;
+                if (window_flag == 0) {
+                    scroll_direction = 1;
+                    if (commit_info_window_count < commit_message_count - 1) {
+                        commit_info_window_count++;
+                        if (cursor_position < lines_to_display) {
+                            cursor_position++;
+                        } else if (starting_line + lines_to_display < commit_message_count) {
+                            starting_line++;
+                        }
+                    }
+                } else if (window_flag == 1) {
+                    if (files_cursor_position < files_changed_lines_to_display && 
+                        changed_files && files_starting_line + files_cursor_position < (int)changed_files->files.size()) {
+                        files_cursor_position++;
+                    } else if (changed_files && files_starting_line + files_changed_lines_to_display < (int)changed_files->files.size()) {
+                        files_starting_line++;
                     }
                 }
-            } else if (window_flag == 1) {
-                if (files_cursor_position > 1) {
-                    files_cursor_position--;
-                } else if (files_starting_line > 0) {
-                    files_starting_line--;
+                else if (window_flag == 2 && blame_view.file) {
+                    int blame_rows = blame_line_count(blame_jobs, *blame_view.file);
+                    blame_view.note.clear();
+                    if (blame_view.cursor_position < diff_content.lines_to_display &&
+                        blame_view.starting_line + blame_view.cursor_position < blame_rows) {
+                        blame_view.cursor_position++;
+                    } else if (blame_view.starting_line + diff_content.lines_to_display < blame_rows) {
+                        blame_view.starting_line++;
+                    }
+                }
+                else if (window_flag == 2 && diff_content.text) {
+                    int diff_rows = diff_pane_rows(side_by_side_view ? &side_by_side : NULL, diff_content.text);
+                    if (diff_content.cursor_position < diff_content.lines_to_display &&
+                        diff_content.starting_line + diff_content.cursor_position < diff_rows) {
+                        diff_content.cursor_position++;
+                    } else if (diff_content.starting_line + diff_content.lines_to_display < diff_rows) {
+                        diff_content.starting_line++;
+                    }
+                }
+            } else if (ch == KEY_UP || ch == 'j') {
+                dirty |= window_flag == 0 ? PANE_HISTORY | PANE_DETAILS : window_flag == 1 ? PANE_FILES : PANE_DIFF;
+                if (window_flag == 0) {
+                    scroll_direction = -1;
+                    if (commit_info_window_count > 0) {
+                        commit_info_window_count--;
+                        if (cursor_position > 1) {
+                            cursor_position--;
+                        } else if (starting_line > 0) {
+                            starting_line--;
+                        }
+                    }
+                } else if (window_flag == 1) {
+                    if (files_cursor_position > 1) {
+                        files_cursor_position--;
+                    } else if (files_starting_line > 0) {
+                        files_starting_line--;
+                    }
                 }
-            }
 
-            else if (window_flag == 2) {
-                if (diff_content.cursor_position > 1) {
-                    diff_content.cursor_position--;
-                } else if (diff_content.starting_line > 0) {
-                    diff_content.starting_line--;
+                else if (window_flag == 2 && blame_view.file) {
+                    blame_view.note.clear();
+                    if (blame_view.cursor_position > 1) {
+                        blame_view.cursor_position--;
+                    } else if (blame_view.starting_line > 0) {
+                        blame_view.starting_line--;
+                    }
+                }
+                else if (window_flag == 2) {
+                    if (diff_content.cursor_position > 1) {
+                        diff_content.cursor_position--;
+                    } else if (diff_content.starting_line > 0) {
+                        diff_content.starting_line--;
+                    }
                 }
             }
         }
+        if (quit) break;
 
-
-
+        // Search once for everything typed in this batch, then jump to the
+        // first match at or after the commit the search started from
+        if (search_changed) {
+            search_changed = false;
+            search_commits(search, commitList, view_rows, commit_message_count);
+            int match = next_match(search, search.origin - 1, 1);
+            select_commit(match >= 0 ? match : search.origin, commit_message_count, lines_to_display,
+                          commit_info_window_count, starting_line, cursor_position);
+        }
     }
 
     // Cleanup
     endwin();
-    git_revwalk_free(walker);
-    git_repository_free(repo);
+    stop_diff_jobs(diff_jobs);
+    stop_blame_jobs(blame_jobs);
+    if (prefetch_depth > 0) stop_prefetcher(prefetcher);
+    stop_diff_stats(diff_stats);
+    if (pickaxe) stop_pickaxe(*pickaxe);
+    if (analytics) stop_analytics(*analytics);
+    if (loading) {
+        loader.stop = true;
+        loader.worker.join();
+    }
+    if (refreshing) history_refresh.worker.join();
+    stop_worktree_status(worktree);
+    close_refs_watch(refs_watch);
+    if (repo) git_repository_free(repo);
     git_libgit2_shutdown();
+    if (bench.enabled) print_bench_report(bench, repo_path, commitList.oids.size());
+    if (instruments.tracing && !write_trace(trace_path)) {
+        fprintf(stderr, "Cannot write trace to %s\n", trace_path.c_str());
+        return 1;
+    }
     
     return 0;
 }